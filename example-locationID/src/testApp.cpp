@@ -44,16 +44,14 @@ void testApp::setup(){
 
     pseye = NULL; 
     
-    vector<ofxMacamPs3EyeDeviceInfo*> deviceList = ofxMacamPs3Eye::getDeviceList();
+    ofxMacamPs3EyeDeviceInfo device;
     
-	for (int i = 0; i < deviceList.size(); i++) {
-        if(deviceList[i]->locationID == LOCATION_ID){
-            pseye = new ofxMacamPs3Eye();
-            pseye->setDeviceID(deviceList[i]->id);
-            pseye->setDesiredFrameRate(180);
-            pseye->initGrabber(320, 240);
-        }
-	}
+    if(ofxMacamPs3Eye::getDeviceInfoByLocationID(LOCATION_ID, device)){
+        pseye = new ofxMacamPs3Eye();
+        pseye->setDeviceID(device.id);
+        pseye->setDesiredFrameRate(180);
+        pseye->initGrabber(320, 240);
+    }
 }
 
 //--------------------------------------------------------------
@@ -6,16 +6,17 @@ void testApp::setup(){
 	
 	ofSetLogLevel(OF_LOG_VERBOSE);	
 	
-	vector<ofxMacamPs3EyeDeviceInfo*> deviceList = ofxMacamPs3Eye::getDeviceInfoList();
+	vector<ofxMacamPs3EyeDeviceInfo> deviceList = ofxMacamPs3Eye::getDeviceList();
 	
 	for (int i = 0; i < deviceList.size(); i++) {
 		ofxMacamPs3Eye * camera = new ofxMacamPs3Eye();
-		camera->setDeviceID(deviceList[i]->id);
-		camera->setDesiredFrameRate(180);
-		camera->initGrabber(320, 240);
+		camera->setDeviceID(deviceList[i].id);
 		cameras.push_back(camera);
 	}
 	
+	// All at once, rather than one initGrabber() after the other
+	ofxMacamPs3Eye::initAll(cameras, 320, 240, 180);
+	
 	if(cameras.size() > 0){
 		ofSetWindowShape(320 * cameras.size(), 240);
 	}
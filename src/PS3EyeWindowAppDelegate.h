@@ -1,7 +1,23 @@
 #import <Cocoa/Cocoa.h>
 #import "MyCameraCentral.h"
+#import "GenericDriver.h"
 
-#define PS3EYE_DELEGATE_BUFFER_SIZE 2
+// The ring of images between the decoding thread and the application, 
+// one slot is always being decoded into, so up to 7 images per update
+#define PS3EYE_DELEGATE_SLOTS 8
+
+// Every image as it comes out of the decoder. Only valid during the callback.
+typedef struct PS3EyeFrame
+{
+	const unsigned char * pixels;  // RGB
+	int width;
+	int height;
+	long rowBytes;
+	UInt64 captureTicks;  // End of the USB transfer, see MonotonicTicks()
+	UInt32 sequence;      // One up per image since the grab started
+} PS3EyeFrame;
+
+typedef void (*PS3EyeFrameCallback)(const PS3EyeFrame * frame, void * userData);
 
 @interface PS3EyeWindowAppDelegate : NSObject <NSApplicationDelegate> {
 	NSWindow *window;
@@ -11,9 +27,18 @@
 	MyCameraCentral* central;
 	MyCameraDriver* driver;
 
-	unsigned char * buffer;
-	
-	struct timeval currentTime;
+	// Image n lives in slot n % PS3EYE_DELEGATE_SLOTS. The decoder fills image 
+	// written, the application holds [released, taken) since its last take and 
+	// [taken, published) waits for the next one. The counters only go up, and 
+	// each has one writer.
+	unsigned char * slots[PS3EYE_DELEGATE_SLOTS];
+	UInt64 slotStamps[PS3EYE_DELEGATE_SLOTS][latencyTotal];
+	UInt32 slotSequence[PS3EYE_DELEGATE_SLOTS];
+	UInt32 written;               // Decoder
+	volatile UInt32 published;    // Decoder
+	volatile UInt32 released;     // Application
+	UInt32 taken;                 // Application
+	volatile uint32_t overflowed; // Images dropped because the ring was full, since the last take
 	
 	BOOL cameraGrabbing;
 	CameraResolution cameraResolution;
@@ -21,16 +46,36 @@
 	int cameraHeight;
 	int cameraFPS;
 	
-	BOOL frameNew;
-	BOOL needsFrame;
+	FrameCounter * deliveredFPS;  // Images as they come out of the driver
+	
+	BufferArena * arena;  // Image buffers here, the driver's grab buffers too
+	
+	PS3EyeFrameCallback frameCallback;  // On the decoding thread, under callbackLock
+	void * frameCallbackData;
+	NSLock * callbackLock;
+	UInt32 frameSequence;
 	
-	float realFps;
+	// On demand the driver gets its next buffer when the application asks for 
+	// a frame, until then it skips decoding. Whoever clears bufferParked hands it over.
+	BOOL decodeOnDemand;
+	volatile int32_t frameDemand;
+	volatile int32_t bufferParked;
 }
 - (BOOL)connectTo:(unsigned long)cid;
 - (void)useWidth:(int)w useHeight:(int)h useFps:(int)f;
 - (BOOL)startGrabbing;
-- (BOOL)isFrameNew;
+- (BOOL)reconfigureWidth:(int)w height:(int)h fps:(int)f;
+- (int) takeNewFrames:(int *) lost;
+- (BOOL) getNewFrame:(int) index frame:(PS3EyeFrame *) frame;
 - (unsigned char *) imageBuffer;
+- (void) framePickedUp;
+- (LatencyStatistics *) latency;
+- (FrameCounter *) frameCounter;
+- (BufferArena *) bufferArena;
+- (void) setFrameCallback:(PS3EyeFrameCallback) callback userData:(void *) userData;
+- (void) setDecodeOnDemand:(BOOL) onDemand;
+- (BOOL) decodeOnDemand;
+- (void) demandFrame;
 - (void)shutdown;
 
 //delegate calls from camera central
@@ -45,6 +90,5 @@
 @property (readonly) MyCameraCentral* central;
 @property (readonly) MyCameraDriver* driver;
 @property (readonly) float realFps;
-@property (atomic) BOOL needsFrame;
 
 @end
@@ -1,8 +1,29 @@
 #import "PS3EyeWindowAppDelegate.h"
+#include "MiscTools.h"
+
+#define PS3EYE_DELEGATE_STOP_TIMEOUT 1000  // ms the decoding thread gets to finish before a restart
+
+// The PS3 Eye only does 640 x 480 and 320 x 240
+static void PS3EyeSnapSize(int * w, int * h)
+{
+	if ((*w - 320) > 160) {
+		*w = 640;
+	}
+	if ((*w - 320) < 160) {
+		*w = 320;
+	}
+	if ((*h - 240) > 120) {
+		*h = 480;
+	}
+	if ((*h - 240) < 120) {
+		*h = 240;
+	}
+}
 
 @implementation PS3EyeWindowAppDelegate
 
-@synthesize window, central, driver, realFps, needsFrame;
+@synthesize window, central, driver;
+
 
 -(id)init {
 	self = [super init];
@@ -13,7 +34,25 @@
 		
 		driver=NULL;
 		
-		buffer = NULL;
+		for (int i = 0; i < PS3EYE_DELEGATE_SLOTS; i++) 
+			slots[i] = NULL;
+		written = published = released = taken = 0;
+		overflowed = 0;
+		
+		deliveredFPS = [[FrameCounter alloc] init];
+		
+		image = NULL;
+		imageRep = NULL;
+		arena = [[BufferArena alloc] init];  // Outlives the drivers, so reconnecting reuses the buffers
+		
+		frameCallback = NULL;
+		frameCallbackData = NULL;
+		callbackLock = [[NSLock alloc] init];
+		frameSequence = 0;
+		
+		decodeOnDemand = NO;
+		frameDemand = 0;
+		bufferParked = 0;
 	}
 	return self;
 }
@@ -45,6 +84,7 @@
 			NSLog(@"Status: Connected to %@", [central nameForID:cid]);
 		}
 		[driver setDelegate:self];
+		[(GenericDriver *)driver setBufferArena:arena];
 		[driver retain];			//We keep our own reference
 		return YES;
 	}
@@ -52,18 +92,7 @@
 }
 
 - (void)useWidth:(int)w useHeight:(int)h useFps:(int)f{
-	if ((w - 320) > 160) {
-		w = 640;
-	}
-	if ((w - 320) < 160) {
-		w = 320;
-	}
-	if ((h - 240) > 120) {
-		h = 480;
-	}
-	if ((h - 240) < 120) {
-		h = 240;
-	}
+	PS3EyeSnapSize(&w, &h);
 	
 	if(w == 320) cameraResolution = ResolutionSIF;
 	else if(w == 640) cameraResolution = ResolutionVGA;
@@ -71,10 +100,25 @@
 	cameraHeight = h;
 	cameraFPS = f;
 	
+	// Give the buffers of the last size back, the same size gets the same memory again
+	if(imageRep != NULL){
+		[image removeRepresentation:imageRep];
+		[imageRep release];
+		imageRep = NULL;
+	}
+	if(image != NULL){
+		[image release];
+		image = NULL;
+	}
+	for (int i = 0; i < PS3EYE_DELEGATE_SLOTS; i++) {
+		[arena recycleBuffer:slots[i]];
+		slots[i] = NULL;
+	}
+	
 	// Insert code here to initialize your application 
 	image=[[NSImage alloc] init];
 	[image setCacheDepthMatchesImageDepth:YES];			//We have to set this to work with thousands of colors
-	imageRep=[[NSBitmapImageRep alloc] initWithBitmapDataPlanes:NULL	//Set up just to avoid a NIL imageRep
+	imageRep=[[NSBitmapImageRep alloc] initWithBitmapDataPlanes:NULL	//Set up just to avoid a NIL imageRep, the images go to the slots
 													 pixelsWide:cameraWidth
 													 pixelsHigh:cameraHeight
 												  bitsPerSample:8	
@@ -89,21 +133,21 @@
 	[image addRepresentation:imageRep]; 
 	
 	
-	imageView = [[[NSImageView alloc] initWithFrame:NSMakeRect(0, cameraHeight, cameraWidth, cameraHeight)] autorelease];
-	imageView.image = image;
-	
-	[window setContentView:imageView];	 
-	[window makeKeyAndOrderFront:self];
-	[window setFrame:NSMakeRect(0, 768, 1024, 768) display:YES];
+	// Only with a window of our own, views belong to the main thread and this may run on another one (see ofxMacamPs3Eye::initAll)
+	if (window != NULL) {
+		imageView = [[[NSImageView alloc] initWithFrame:NSMakeRect(0, cameraHeight, cameraWidth, cameraHeight)] autorelease];
+		imageView.image = image;
+		
+		[window setContentView:imageView];	 
+		[window makeKeyAndOrderFront:self];
+		[window setFrame:NSMakeRect(0, 768, 1024, 768) display:YES];
+	}
 	
 	[driver setResolution:cameraResolution fps:cameraFPS];
 	
-	// Allocate the buffers
-	if(buffer != NULL){
-		delete buffer;
-		buffer = NULL;
-	}
-	buffer = new unsigned char[cameraWidth * cameraHeight * 3];
+	// Allocate the buffers, the decoder writes straight into them
+	for (int i = 0; i < PS3EYE_DELEGATE_SLOTS; i++) 
+		slots[i] = (unsigned char *) [arena bufferOfSize:cameraWidth * cameraHeight * 3];
 }
 
 - (BOOL) startGrabbing { 
@@ -116,8 +160,13 @@
 		 //		 [sizePopup setEnabled:NO];
 		 //		 [compressionSlider setEnabled:NO];
 		 //		 [reduceBandwidthCheckbox setEnabled:NO];
-		 [driver setImageBuffer:[imageRep bitmapData] bpp:3 rowBytes:[driver width]*3];
-		 needsFrame = false;
+		 written = published = released = taken = 0;
+		 overflowed = 0;
+		 [driver setImageBuffer:slots[0] bpp:3 rowBytes:[driver width]*3];
+		 [deliveredFPS reset];
+		 frameSequence = 0;
+		 frameDemand = 0;
+		 bufferParked = 0;
 		 return YES;
 	 }
 	 else{
@@ -126,17 +175,141 @@
 	 }
 }
 
-- (BOOL)isFrameNew
-{
-	if (frameNew) {
-		frameNew = false;
-		return true;
+//
+// Another size or frame rate without letting go of the camera. A frame rate the 
+// driver can switch to on the fly only touches the sensor registers. Anything 
+// else stops the stream and starts it again on the same connection, the arena 
+// hands the buffers of an unchanged size straight back. NO if the camera isn't 
+// grabbing or didn't start again, then it has to be connected anew.
+//
+- (BOOL) reconfigureWidth:(int)w height:(int)h fps:(int)f{
+	if (driver == NULL || !cameraGrabbing || ![driver isGrabbing]) return NO;
+	
+	PS3EyeSnapSize(&w, &h);
+	CameraResolution r = (w == 640) ? ResolutionVGA : ResolutionSIF;
+	if (![driver supportsResolution:r fps:f]) return NO;
+	
+	if (w == cameraWidth && h == cameraHeight && [(GenericDriver *)driver reconfigureResolution:r fps:f]){
+		cameraFPS = f;
+		return YES;
 	}
-	return false;
+	
+	[driver stopGrabbing];
+	cameraGrabbing = NO;
+	if (![driver waitForGrabbingToStop:PS3EYE_DELEGATE_STOP_TIMEOUT]) return NO;
+	
+	[self useWidth:w useHeight:h useFps:f];
+	return [self startGrabbing];
 }
 
+//
+// Give the images of the last take back to the decoder and take all that came 
+// in since, oldest first. Returns how many, 0 keeps the last take. lost is 
+// what didn't fit in the ring in the meantime.
+//
+- (int) takeNewFrames:(int *) lost
+{
+	UInt32 available = published;
+	
+	if (lost != NULL) 
+		*lost = AtomicExchange32((volatile int32_t *) &overflowed, 0);
+	
+	if (decodeOnDemand) 
+		[self demandFrame];  // For the next take
+	
+	if (available == taken) 
+		return 0;
+	
+	AtomicBarrier();  // Done with the old images before the decoder may have them
+	released = taken;
+	taken = available;
+	
+	return taken - released;
+}
+
+// Image index of the last take, valid until the next take
+- (BOOL) getNewFrame:(int) index frame:(PS3EyeFrame *) frame
+{
+	if (index < 0 || index >= (int) (taken - released)) 
+		return NO;
+	
+	int slot = (released + index) % PS3EYE_DELEGATE_SLOTS;
+	
+	frame->pixels = slots[slot];
+	frame->width = cameraWidth;
+	frame->height = cameraHeight;
+	frame->rowBytes = cameraWidth * 3;
+	frame->captureTicks = slotStamps[slot][latencyUsbComplete];
+	frame->sequence = slotSequence[slot];
+	
+	return YES;
+}
+
+// The newest image of the last take
 - (unsigned char *) imageBuffer{
-	return buffer;
+	if (taken == released) 
+		return NULL;
+	
+	return slots[(taken - 1) % PS3EYE_DELEGATE_SLOTS];
+}
+
+// The application took the images of the last take, that's the last latency stage
+- (void) framePickedUp{
+	UInt64 now = MonotonicTicks();
+	
+	for (UInt32 i = released; i != taken; i++) {
+		int slot = i % PS3EYE_DELEGATE_SLOTS;
+		slotStamps[slot][latencyPickedUp] = now;
+		[[self latency] recordStamps:slotStamps[slot] from:latencyDelivered to:latencyPickedUp];
+	}
+}
+
+- (LatencyStatistics *) latency{
+	return [(GenericDriver *)driver latency];
+}
+
+// Averaged over a sliding window of monotonic timestamps, see FrameCounter
+- (float) realFps{
+	return [deliveredFPS getFPS];
+}
+
+- (FrameCounter *) frameCounter{
+	return deliveredFPS;
+}
+
+- (BufferArena *) bufferArena{
+	return arena;
+}
+
+// Decode only the frames the application asks for (with every update), unless there is a frame callback
+- (void) setDecodeOnDemand:(BOOL) onDemand{
+	decodeOnDemand = onDemand;
+	[self demandFrame];  // Don't leave a buffer parked
+}
+
+- (BOOL) decodeOnDemand{
+	return decodeOnDemand;
+}
+
+- (void) demandFrame{
+	AtomicExchange32(&frameDemand, 1);
+	[self unparkBuffer];
+}
+
+- (void) unparkBuffer{
+	if (!AtomicCompareAndSwap32(&bufferParked, 1, 0)) 
+		return;
+	
+	AtomicExchange32(&frameDemand, 0);
+	[driver setImageBuffer:slots[written % PS3EYE_DELEGATE_SLOTS] bpp:3 rowBytes:cameraWidth * 3];
+}
+
+// Once this returns the old callback isn't running and won't be called again
+- (void) setFrameCallback:(PS3EyeFrameCallback) callback userData:(void *) userData{
+	[callbackLock lock];
+	frameCallback = callback;
+	frameCallbackData = userData;
+	[callbackLock unlock];
 }
 
 - (void) shutdown{
@@ -159,25 +332,52 @@
 {
 	if (cam!=driver) return;	//probably an old one
 
+	[deliveredFPS addFrame];  // Always from the decoding thread, so a single writer
 	
-	struct timeval lastTime = currentTime;
-	struct timeval difference;
-	gettimeofday(&currentTime, NULL);
+	//[imageView display];
 	
-	timersub(&currentTime, &lastTime, &difference);
-    int diff = (int) (difference.tv_sec * 1000 + difference.tv_usec / 1000) / 2;
-
-	realFps = 1000.0 / (float)diff;
+	int slot = written % PS3EYE_DELEGATE_SLOTS;
 	
-	//[imageView display];
-	[driver setImageBuffer:[driver imageBuffer] bpp:[driver imageBufferBPP] rowBytes:[driver imageBufferRowBytes]];
-
-	if(needsFrame){
-		memcpy(buffer, [driver imageBuffer], cameraWidth * cameraHeight * 3 * sizeof(unsigned char));
-		frameNew = true;
-		needsFrame = false;
+	[(GenericDriver *)driver getImageBufferStamps:slotStamps[slot]];
+	frameSequence++;
+	slotSequence[slot] = frameSequence;
+	
+	// Show it to whoever wants every image, the slot is still ours
+	[callbackLock lock];
+	if (frameCallback != NULL) {
+		PS3EyeFrame frame;
+		frame.pixels = slots[slot];
+		frame.width = cameraWidth;
+		frame.height = cameraHeight;
+		frame.rowBytes = [driver imageBufferRowBytes];
+		frame.captureTicks = slotStamps[slot][latencyUsbComplete];
+		frame.sequence = frameSequence;
+		
+		(*frameCallback)(&frame, frameCallbackData);  // Inside the "imageReady" trace span
+	}
+	[callbackLock unlock];
+	
+	// Publish the image if the next one has a free slot, otherwise drop it and decode the next one over it
+	
+	if ((UInt32) (written + 1 - released) < PS3EYE_DELEGATE_SLOTS) {
+		written++;
+		AtomicBarrier();  // The image before the count
+		published = written;
+	}
+	else {
+		AtomicIncrement32((volatile int32_t *) &overflowed);
+		AtomicCount32(&[(GenericDriver *)driver grabStatistics]->framesNotConsumed);
+	}
+	
+	// On demand the next buffer waits for the application, unless it has asked already
+	if (decodeOnDemand && frameCallback == NULL) {
+		AtomicExchange32(&bufferParked, 1);
+		if (frameDemand) 
+			[self unparkBuffer];
+		return;
 	}
 	
+	[driver setImageBuffer:slots[written % PS3EYE_DELEGATE_SLOTS] bpp:[driver imageBufferBPP] rowBytes:[driver imageBufferRowBytes]];
 }
 
 - (void) updateStatus:(NSString *)status fpsDisplay:(float)fpsDisplay fpsReceived:(float)fpsReceived
@@ -216,6 +416,10 @@
 }
 - (void) dealloc 
 {
+	[deliveredFPS release];
+	[imageRep release];
+	[arena release];  // The buffers go when the last driver lets go of it too
+	[callbackLock release];
 	
 	[super dealloc];
 }
@@ -12,6 +12,7 @@
 #import "GenericDriver.h"
 
 #include <unistd.h>
+#include <math.h>
 
 
 @implementation AGC
@@ -40,6 +41,12 @@
     updateInterval = fastUpdate;
     gettimeofday(&tvLastUpdate, NULL);
     
+    proportionalGain = 0.8;
+    integralGain = 0.1;
+    integral = 0.0;
+    settleFrames = 2;  // the sensor needs a frame or two before a change shows
+    settleCount = 0;
+    
     return self;
 }
 
@@ -47,6 +54,15 @@
 - (void) setMode:(AGCMode) newMode
 {
     mode = newMode;
+    
+    integral = 0.0;
+    settleCount = 0;
+}
+
+
+- (AGCMode) mode
+{
+    return mode;
 }
 
 
@@ -132,6 +148,58 @@
 }
 
 
+//
+// How much an effect multiplies the exposure at a given setting, 
+// according to the driver's model of the camera
+//
+- (float) getEffectFactor:(AGCEffect)effect at:(float)value
+{
+    switch (effect)
+    {
+        case agcAffectGain:
+            return [driver gainFactorFor:value];
+            break;
+            
+        case agcAffectShutter: 
+            return [driver shutterFactorFor:value];
+            break;
+            
+        case agcAffectOffset: 
+        case agcAffectBrightness:
+        case agcAffectNone:
+        default:
+            break;
+    }
+    
+    return 1.0;
+}
+
+//
+// Find the setting that comes closest to a given factor
+//
+- (float) getEffect:(AGCEffect)effect forFactor:(float)factor
+{
+    float step = [self getEffectStep:effect];
+    int k, steps = (int) (1.0 / step + 0.5);
+    float best = 0.0;
+    float bestError = HUGE_VALF;
+    
+    for (k = 0; k <= steps; k++) 
+    {
+        float value = (k * step > 1.0) ? 1.0 : k * step;
+        float error = fabsf(log2f([self getEffectFactor:effect at:value] / factor));
+        
+        if (error < bestError) 
+        {
+            best = value;
+            bestError = error;
+        }
+    }
+    
+    return best;
+}
+
+
 - (void) setEffect:(AGCEffect)effect toValue:(float)value
 {
     switch (effect)
@@ -173,6 +241,9 @@
     if (mode == agcHistogram) 
         return [self updateHistogram:histogram];
     
+    if (mode == agcProportionalIntegral) 
+        return [self updateProportionalIntegral:histogram];
+    
     return NO;
 }
 
@@ -212,6 +283,18 @@
         return NO;
     
     tvLastUpdate = currentTime;
+    
+    // Use the zones if the decoder filled them in, they are much cheaper 
+    // than going over the whole image again and allow for metering
+    
+    if ([histogram hasZones]) 
+    {
+        if (![histogram processZones]) 
+            return NO;
+        
+        return [self updateVersion1:[histogram getMeteredLuminance]];
+    }
+    
     if (![histogram processRGB]) 
         return NO;
     
@@ -280,4 +363,89 @@
     return change;
 }
 
+//
+// Proportional-integral control of the exposure, in stops (log2)
+//
+// Rather than stepping towards the target, work out the total exposure 
+// needed from the measured luminance and the driver's model of the effects. 
+// The first effect (usually the shutter) is used up before the second one 
+// (usually the gain) is touched. Registers are only written when the 
+// quantized setting actually changes, and the next couple of frames are 
+// skipped so that the measurement reflects the change.
+//
+- (BOOL) updateProportionalIntegral:(Histogram *) histogram
+{
+    BOOL change = NO;
+    int measured;
+    
+    if (settleCount > 0) 
+    {
+        settleCount--;
+        return NO;
+    }
+    
+    if ([histogram hasZones]) 
+    {
+        if (![histogram processZones]) 
+            return NO;
+        
+        measured = [histogram getMeteredLuminance];
+    }
+    else 
+    {
+        if (![histogram processRGB]) 
+            return NO;
+        
+        measured = [histogram getMedian];
+    }
+    
+    float error = log2f(target / (float) ((measured > 1) ? measured : 1));
+    float deadband = log2f((target + delta) / (float) target);
+    
+    if (fabsf(error) < deadband) 
+        return NO;
+    
+    integral += error;
+    integral = CLAMP(integral, -4.0, 4.0);
+    
+    float correction = proportionalGain * error + integralGain * integral;
+    
+    float e1 = [self getEffect:effect1];
+    float e2 = [self getEffect:effect2];
+    
+    float f1 = [self getEffectFactor:effect1 at:e1];
+    float f2 = [self getEffectFactor:effect2 at:e2];
+    
+    float exposure = f1 * f2 * exp2f(correction);
+    
+    float n1 = [self getEffect:effect1 forFactor:exposure / [self getEffectFactor:effect2 at:0.0]];
+    float n2 = [self getEffect:effect2 forFactor:exposure / [self getEffectFactor:effect1 at:n1]];
+    
+    if ([self getEffectFactor:effect1 at:n1] != f1) 
+    {
+        [self setEffect:effect1 toValue:n1];
+        change = YES;
+    }
+    
+    if ([self getEffectFactor:effect2 at:n2] != f2) 
+    {
+        [self setEffect:effect2 toValue:n2];
+        change = YES;
+    }
+    
+    if (change) 
+    {
+#if REALLY_VERBOSE
+        NSLog(@"exposure error %f stops, setting effect1 to %f, effect2 to %f", error, n1, n2);
+#endif
+        settleCount = settleFrames;
+    }
+    else 
+    {
+        integral -= error;  // At the limits, don't wind up
+    }
+    
+    return change;
+}
+
 @end
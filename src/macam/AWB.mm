@@ -0,0 +1,113 @@
+//
+//  AWB.m
+//  macam
+//
+//  Software white balance, alongside the AGC.
+//
+
+
+#import "AWB.h"
+#import "Histogram.h"
+#import "GenericDriver.h"
+
+#include <unistd.h>
+
+
+@implementation AWB
+
+- (id) initWithDriver:(GenericDriver *) theDriver
+{
+	self = [super init];
+	if (self == NULL) 
+        return NULL;
+    
+    driver = theDriver;
+    
+    enabled = NO;
+    
+    maxStep = 0.05;
+    tolerance = 0.02;
+    
+    updateInterval = 250;  // in ms
+    gettimeofday(&tvLastUpdate, NULL);
+    
+    return self;
+}
+
+
+- (void) setEnabled:(BOOL) enable
+{
+    enabled = enable;
+}
+
+
+- (BOOL) isEnabled
+{
+    return enabled;
+}
+
+//
+// Limit a correction factor to the allowed step, ignore small ones
+//
+- (float) limit:(float) factor
+{
+    if (factor > 1.0 - tolerance && factor < 1.0 + tolerance) 
+        return 1.0;
+    
+    return CLAMP(factor, 1.0 - maxStep, 1.0 + maxStep);
+}
+
+
+- (BOOL) update:(Histogram *) histogram
+{
+    struct timeval currentTime, difference;
+    int diffMilliSeconds;
+    
+    if (!enabled || ![histogram hasChroma]) 
+        return NO;
+    
+    gettimeofday(&currentTime, NULL);
+    timersub(&currentTime, &tvLastUpdate, &difference);
+    diffMilliSeconds = (int) (difference.tv_sec * 1000 + difference.tv_usec / 1000);
+    
+    if (diffMilliSeconds < updateInterval) 
+        return NO;
+    
+    tvLastUpdate = currentTime;
+    
+    // Average color, from the average YUV (ITU-R BT.601)
+    
+    float c = [histogram getAverageLuminance] - 16;
+    float d = [histogram getAverageU] - 128;
+    float e = [histogram getAverageV] - 128;
+    
+    if (c < 16 || c > 200)  // Too dark or too bright to judge the color
+        return NO;
+    
+    float r = 298 * c           + 409 * e;
+    float g = 298 * c - 100 * d - 208 * e;
+    float b = 298 * c + 516 * d;
+    
+    if (r <= 0 || g <= 0 || b <= 0) 
+        return NO;
+    
+    float blueFactor = [self limit:g / b];
+    float redFactor = [self limit:g / r];
+    
+    if (blueFactor == 1.0 && redFactor == 1.0) 
+        return NO;
+    
+    if (blueFactor != 1.0) 
+        [driver setBlueGain:CLAMP([driver blueGain] * blueFactor, 0.0, 1.0)];
+    
+    if (redFactor != 1.0) 
+        [driver setRedGain:CLAMP([driver redGain] * redFactor, 0.0, 1.0)];
+    
+#if REALLY_VERBOSE
+    NSLog(@"AWB: blue gain %f, red gain %f", [driver blueGain], [driver redGain]);
+#endif
+    
+    return YES;
+}
+
+@end
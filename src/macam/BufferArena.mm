@@ -0,0 +1,172 @@
+//
+//  BufferArena.m
+//  macam
+//
+//  Keeps the big buffers of a camera around between grabs.
+//
+
+#import "BufferArena.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+
+@implementation BufferArena
+
+- (id) init
+{
+	self = [super init];
+	if (self == NULL) 
+        return NULL;
+    
+    blocks = NULL;
+    numBlocks = 0;
+    maxBlocks = 0;
+    lock = [[NSLock alloc] init];
+    
+    return self;
+}
+
+
+- (void) dealloc
+{
+    int i;
+    
+    for (i = 0; i < numBlocks; i++) 
+        free(blocks[i].data);
+    
+    if (blocks != NULL) 
+        free(blocks);
+    
+    [lock release];
+    
+    [super dealloc];
+}
+
+//
+// An unused block of exactly this size, or a new one
+//
+- (void *) bufferOfSize:(size_t) size
+{
+    size_t pageSize = getpagesize();
+    size_t alignment = (size >= pageSize) ? pageSize : BUFFER_ARENA_ALIGNMENT;
+    void * data = NULL;
+    int i;
+    
+    if (size == 0) 
+        return NULL;
+    
+    [lock lock];
+    
+    for (i = 0; i < numBlocks; i++) 
+    {
+        if (!blocks[i].inUse && blocks[i].size == size) 
+        {
+            blocks[i].inUse = YES;
+            data = blocks[i].data;
+            break;
+        }
+    }
+    
+    if (data == NULL && numBlocks == maxBlocks) 
+    {
+        int newMax = (maxBlocks > 0) ? 2 * maxBlocks : 16;
+        BufferArenaBlock * newBlocks = (BufferArenaBlock *) realloc(blocks, newMax * sizeof(BufferArenaBlock));
+        
+        if (newBlocks != NULL) 
+        {
+            blocks = newBlocks;
+            maxBlocks = newMax;
+        }
+    }
+    
+    if (data == NULL && numBlocks < maxBlocks && posix_memalign(&data, alignment, size) == 0) 
+    {
+        memset(data, 0, size);  // Fault the pages in now rather than while grabbing
+        
+        blocks[numBlocks].data = data;
+        blocks[numBlocks].size = size;
+        blocks[numBlocks].inUse = YES;
+        numBlocks++;
+    }
+    
+    [lock unlock];
+    
+    return data;
+}
+
+
+- (void) recycleBuffer:(void *) data
+{
+    int i;
+    
+    if (data == NULL) 
+        return;
+    
+    [lock lock];
+    
+    for (i = 0; i < numBlocks; i++) 
+    {
+        if (blocks[i].data == data) 
+        {
+            blocks[i].inUse = NO;
+            break;
+        }
+    }
+    
+    [lock unlock];
+    
+    if (i == numBlocks) 
+        NSLog(@"BufferArena: recycleBuffer got a buffer that isn't ours");
+}
+
+
+- (void) trim
+{
+    int i, kept = 0;
+    
+    [lock lock];
+    
+    for (i = 0; i < numBlocks; i++) 
+    {
+        if (blocks[i].inUse) 
+            blocks[kept++] = blocks[i];
+        else 
+            free(blocks[i].data);
+    }
+    
+    numBlocks = kept;
+    
+    [lock unlock];
+}
+
+
+- (size_t) footprint
+{
+    size_t total = 0;
+    int i;
+    
+    [lock lock];
+    for (i = 0; i < numBlocks; i++) 
+        total += blocks[i].size;
+    [lock unlock];
+    
+    return total;
+}
+
+
+- (size_t) bytesInUse
+{
+    size_t total = 0;
+    int i;
+    
+    [lock lock];
+    for (i = 0; i < numBlocks; i++) 
+        if (blocks[i].inUse) 
+            total += blocks[i].size;
+    [lock unlock];
+    
+    return total;
+}
+
+@end
@@ -8,7 +8,19 @@
 
 #import "FrameCounter.h"
 
-#include <unistd.h>
+#include "MiscTools.h"
+#include <math.h>
+
+
+typedef struct FrameIntervals
+{
+    int count;      // Frames in the window
+    double span;    // ms from the first to the last of them
+    double mean;    // ms
+    double stddev;  // ms
+    double min;     // ms
+    double max;     // ms
+} FrameIntervals;
 
 
 @implementation FrameCounter
@@ -29,88 +41,163 @@
 
 - (void) reset
 {
-    timeset = NO;
     frameCount = 0;
-    cumulativeFPS = 0.0;
-    currentFPS = 0.0;
-    lastFPS = 0.0;
+    start = 0;
+    lastReport = 0;
+    AtomicBarrier();
 }
 
 
 - (void) setInterval:(long) newInterval
 {
-    interval = newInterval;
+    interval = CLAMP(newInterval, 1, FRAME_COUNTER_MAX_INTERVAL);
 }
 
 
 - (void) addFrame
 {
-    if (!timeset) 
-    {
-        gettimeofday(&start, NULL);
-        timeset = YES;
-    }
+    UInt64 now = MonotonicTicks();
+    
+    if (frameCount == 0) 
+        start = now;
     
-    frameCount++;
+    stamps[frameCount & (FRAME_COUNTER_RING - 1)] = now;
+    AtomicIncrement32(&frameCount);  // Publishes the stamp
 }
 
-
-- (BOOL) update
+//
+// Go over the frames of the last few ms, newest first. 
+// Frames that may have been overwritten while reading are left out. 
+//
+- (FrameIntervals) intervalsInWindow:(long) window
 {
-    struct timeval currentTime, difference;
-    int diffMilliSeconds;
+    FrameIntervals result = { 0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    UInt64 windowTicks = MillisecondsToTicks(window);
+    UInt64 copy[FRAME_COUNTER_RING];
+    UInt64 now;
+    int32_t end, valid, i;
+    int n = 0;
+    
+    end = frameCount;
+    AtomicBarrier();
+    now = MonotonicTicks();  // After reading the count, so no stamp is newer
+    
+    for (i = end - 1; i >= 0 && i > end - FRAME_COUNTER_RING; i--) 
+    {
+        UInt64 stamp = stamps[i & (FRAME_COUNTER_RING - 1)];
+        
+        if (now - stamp > windowTicks) 
+            break;
+        
+        copy[n++] = stamp;
+    }
     
-    if (frameCount < currentFPS) 
-        return NO;
+    AtomicBarrier();
+    valid = end - (frameCount - FRAME_COUNTER_RING) - 1;  // Anything older than this got reused, or is being
+    if (n > valid) 
+        n = (valid > 0) ? valid : 0;
     
-    // check the time
-    // update if necessary
+    result.count = n;
     
-    gettimeofday(&currentTime, NULL);
-    timersub(&currentTime, &start, &difference);
-    diffMilliSeconds = (int) (difference.tv_sec * 1000 + difference.tv_usec / 1000);
+    if (n < 2) 
+        return result;
     
-    //    NSLog(@"update difference = %d ms.\n", diffMilliSeconds);
+    double sum = 0.0, sumSquares = 0.0;
     
-    if (diffMilliSeconds < interval) 
-        return NO;
+    result.min = HUGE_VAL;
     
-    int count = frameCount;
-    frameCount = 0;
-    float newFPS = 1000.0 * count / diffMilliSeconds;
+    for (i = 0; i < n - 1; i++) 
+    {
+        double ms = TicksToMilliseconds(copy[i] - copy[i + 1]);
+        
+        sum += ms;
+        sumSquares += ms * ms;
+        
+        if (ms < result.min) 
+            result.min = ms;
+        
+        if (ms > result.max) 
+            result.max = ms;
+    }
     
-    frameCount = 0;
-    start = currentTime;
+    result.span = sum;
+    result.mean = sum / (n - 1);
+    result.stddev = sqrt(fmax(sumSquares / (n - 1) - result.mean * result.mean, 0.0));
     
-    lastFPS = currentFPS;
-    currentFPS = newFPS;
-    cumulativeFPS = (newFPS + cumulativeFPS) / 2;
+    return result;
+}
+
+//
+// Returns YES once per interval, for reporting
+//
+- (BOOL) update
+{
+    int64_t last = lastReport;
+    int64_t now = MonotonicTicks();
+    
+    if (frameCount == 0) 
+        return NO;
     
-    return YES;
+    if (last == 0) 
+    {
+        AtomicCompareAndSwap64(&lastReport, last, now);
+        return NO;
+    }
+    
+    if (TicksToMilliseconds(now - last) < interval) 
+        return NO;
+    
+    return AtomicCompareAndSwap64(&lastReport, last, now);
 }
 
 
 - (float) getFPS
 {
-    [self update];
+    FrameIntervals frames = [self intervalsInWindow:interval];
     
-    return (currentFPS + lastFPS) / 2;
+    return (frames.span > 0.0) ? 1000.0 * (frames.count - 1) / frames.span : 0.0;
 }
 
 
+//
+// Same window as getFPS now, kept for the callers that ask for this one
+//
 - (float) getCurrentFPS
 {
-    [self update];
-    
-    return currentFPS;
+    return [self getFPS];
 }
 
 
 - (float) getCumulativeFPS
 {
-    [self update];
+    int32_t count = frameCount;
+    double ms = TicksToMilliseconds(MonotonicTicks() - start);
     
-    return cumulativeFPS;
+    return (count > 1 && ms > 0.0) ? 1000.0 * (count - 1) / ms : 0.0;
+}
+
+
+- (float) getJitter
+{
+    return [self intervalsInWindow:interval].stddev;
+}
+
+
+- (float) getMinInterval
+{
+    return [self intervalsInWindow:interval].min;
+}
+
+
+- (float) getMaxInterval
+{
+    return [self intervalsInWindow:interval].max;
+}
+
+
+- (int) getFrameCount
+{
+    return frameCount;
 }
 
 @end
@@ -27,13 +27,17 @@
 //#import "MyController.h"         // user interface
 #import "Histogram.h"
 #import "AGC.h"
+#import "AWB.h"
 #import "FrameCounter.h"
 
 #include "MiscTools.h"
+#include "PipelineTrace.h"
 #include "Resolvers.h"
 
 #include <unistd.h>
 
+static BOOL sharedDecoding = NO;  // See CreateSharedDecodeQueue()
+
 // 
 // This driver provides more of the common code that most drivers need, while 
 // separating out the code that make cameras different into smaller routines. 
@@ -79,6 +83,10 @@
     minimumBufferLength = 0;
     
     grabbingThreadRunning = NO;
+    grabbingThreadFinished = dispatch_semaphore_create(0);
+    grabContext.chunkReady = dispatch_semaphore_create(0);
+    grabContext.chunkFreed = dispatch_semaphore_create(0);
+    queuePolicy = queueOldestFirst;
 	bayerConverter = NULL;
     LUT = NULL;
     rotate = NO;
@@ -86,6 +94,18 @@
     histogram = [[Histogram alloc] init];
     agc = [[AGC alloc] initWithDriver:self];
     
+    awb = [[AWB alloc] initWithDriver:self];
+    blueGain = 0.5;
+    redGain = 0.5;
+    
+    agcSnapshot = [[Histogram alloc] init];
+    agcWorking = [[Histogram alloc] init];
+    agcSnapshotLock = [[NSLock alloc] init];
+    agcCondition = [[NSCondition alloc] init];
+    agcSnapshotReady = NO;
+    agcThreadRunning = NO;
+    agcThreadShouldBeRunning = NO;
+    
     hardwareBrightness = NO;
     hardwareContrast = NO;
     hardwareSaturation = NO;
@@ -117,6 +137,12 @@
     displayFPS = [[FrameCounter alloc] init];
     receiveFPS = [[FrameCounter alloc] init];
     
+    [self resetGrabStatistics];
+    
+    latency = [[LatencyStatistics alloc] init];
+    arena = [[BufferArena alloc] init];
+    memset(lastImageStamps, 0, sizeof(lastImageStamps));
+    
 	return self;
 }
 
@@ -131,6 +157,8 @@
     if (error = [self usbConnectToCam:usbLocationId configIdx:0]) 
         return error; // setup connection to camera
     
+    grabContext.traceCamera = [cameraInfo cid];
+    
     mainToButtonThreadConnection = NULL;
     buttonToMainThreadConnection = NULL;
     
@@ -201,6 +229,18 @@
     
 	[self cleanupGrabContext];
     
+    [awb release];
+    [latency release];
+    [arena release];
+    [agcSnapshot release];
+    [agcWorking release];
+    [agcSnapshotLock release];
+    [agcCondition release];
+    
+    dispatch_release(grabContext.chunkReady);
+    dispatch_release(grabContext.chunkFreed);
+    dispatch_release(grabbingThreadFinished);
+    
 	[super dealloc];
 }
 
@@ -324,6 +364,212 @@
         [bayerConverter setMakeImageStats:v];
 }
 
+//
+// What got lost where, see GenericGrabStatistics
+//
+- (GenericGrabStatistics *) grabStatistics
+{
+    return &statistics;
+}
+
+- (void) resetGrabStatistics
+{
+    memset((void *) &statistics, 0, sizeof(statistics));
+}
+
+//
+// Latency, the application adds the pick up stage (see [LatencyStatistics])
+//
+- (LatencyStatistics *) latency
+{
+    return latency;
+}
+
+//
+// Only valid during [imageReady:]
+//
+- (void) getImageBufferStamps:(UInt64 *) stamps
+{
+    memcpy(stamps, lastImageStamps, sizeof(lastImageStamps));
+}
+
+//
+// Share an arena that outlives this driver, so reconnecting to the camera 
+// gets the same buffers back. Only while not grabbing.
+//
+- (void) setBufferArena:(BufferArena *) newArena
+{
+    if (newArena == NULL || newArena == arena || isGrabbing) 
+        return;
+    
+    [newArena retain];
+    [arena release];
+    arena = newArena;
+}
+
+
+- (BufferArena *) bufferArena
+{
+    return arena;
+}
+
+//
+// Choose between the camera's own exposure control (agcNone) and the software AGC. 
+// Drivers look at the mode in [setAutoGain] to decide whether to enable the sensor's.
+//
+- (void) setAgcMode:(AGCMode) mode
+{
+    [agc setMode:mode];
+    
+    if ([self canSetAutoGain]) 
+        [self setAutoGain:[self isAutoGain]];
+}
+
+
+- (AGCMode) agcMode
+{
+    return [agc mode];
+}
+
+//
+// Which part of the image the software AGC pays attention to
+//
+- (void) setMeteringMode:(MeteringMode) mode
+{
+    [agcSnapshotLock lock];
+    [histogram setMeteringMode:mode];
+    [agcSnapshot setMeteringMode:mode];
+    [agcSnapshotLock unlock];
+}
+
+
+- (void) setMeteringMask:(const float *) weights
+{
+    [agcSnapshotLock lock];
+    [histogram setMeteringMask:weights];
+    [agcSnapshot setMeteringMask:weights];
+    [agcSnapshotLock unlock];
+}
+
+//
+// Can be changed while grabbing, the next chunk follows the new policy
+//
+- (void) setQueuePolicy:(ChunkQueuePolicy) policy
+{
+    queuePolicy = policy;
+    grabContext.queuePolicy = policy;
+}
+
+
+- (ChunkQueuePolicy) queuePolicy
+{
+    return queuePolicy;
+}
+
+//
+// The fewest transfers the camera streams with, setBufferDepth can't go below it
+//
+- (int) minimumNumberOfTransfers
+{
+    return 1;
+}
+
+//
+// A chunk nobody asked an image for can still tell the AGC and AWB what the 
+// scene looks like. Fill the histogram zones from a cheap look at the raw data 
+// and return YES. The default has no idea how to do that.
+//
+- (BOOL) sampleChunkStatistics:(GenericChunkBuffer *) buffer
+{
+    return NO;
+}
+
+//
+// For all cameras, from their next start on
+//
++ (void) setSharedDecoding:(BOOL) shared
+{
+    sharedDecoding = shared;
+}
+
+
++ (BOOL) sharedDecoding
+{
+    return sharedDecoding;
+}
+
+//
+// A new frame rate usually means stopping the stream and starting it again. A 
+// driver that can reprogram the rate of a running stream says so, and does it 
+// in [setFrameRateWhileGrabbing:], which is called with the state lock held.
+//
+- (BOOL) canSetFrameRateWhileGrabbing
+{
+    return NO;
+}
+
+
+- (BOOL) setFrameRateWhileGrabbing:(short) fr
+{
+    return NO;
+}
+
+//
+// Not grabbing, this is just [setResolution:fps:]. While grabbing, only a new 
+// frame rate at the same resolution can be done, if the driver can do it on 
+// the fly. Returns NO otherwise, then the stream has to be restarted.
+//
+- (BOOL) reconfigureResolution:(CameraResolution) r fps:(short) fr
+{
+    BOOL ok = NO;
+    
+    if (![self supportsResolution:r fps:fr]) 
+        return NO;
+    
+    [stateLock lock];
+    
+    if (!isGrabbing) 
+    {
+        [stateLock unlock];
+        [self setResolution:r fps:fr];
+        return YES;
+    }
+    
+    if (r == resolution) 
+    {
+        if (fr == fps) 
+            ok = YES;
+        else if ([self canSetFrameRateWhileGrabbing]) 
+            ok = [self setFrameRateWhileGrabbing:fr];
+    }
+    
+    [stateLock unlock];
+    
+    return ok;
+}
+
+//
+// Settings written before the sensor is up can get lost. A driver that can 
+// tell says whether the sensor answers, remembers the registers written after 
+// [startRegisterShadow] and reads them back in [verifyRegisterShadow], which 
+// returns how many didn't stick. Without that, the camera is taken at its word.
+//
+- (BOOL) isSensorReady
+{
+    return YES;
+}
+
+
+- (void) startRegisterShadow
+{
+}
+
+
+- (int) verifyRegisterShadow
+{
+    return 0;
+}
+
 // Orientation
 
 - (BOOL) canSetOrientationTo:(OrientationMode) m
@@ -426,7 +672,7 @@
             break;
             
         case WhiteBalanceAutomatic:
-            ok = bayerConverter != NULL;
+            ok = bayerConverter != NULL || [self canSetChannelGains];
             break;
             
         default:
@@ -479,12 +725,44 @@
         case WhiteBalanceAutomatic:
             if (bayerConverter != NULL) 
                 [bayerConverter setGainsDynamic:YES];
+            else if (LUT != NULL) 
+                [LUT setGainsRed:1.0f green:1.0f blue:1.0f];  // The sensor gains do the work
             break;
             
         case WhiteBalanceManual:
             // not handled yet
             break;
     }
+    
+    [awb setEnabled:(whiteBalanceMode == WhiteBalanceAutomatic && bayerConverter == NULL && [self canSetChannelGains])];
+}
+
+//
+// Channel gains, for cameras that can adjust blue and red in the sensor
+//
+- (BOOL) canSetChannelGains
+{
+    return NO;
+}
+
+- (float) blueGain
+{
+    return blueGain;
+}
+
+- (void) setBlueGain: (float) v
+{
+    blueGain = v;
+}
+
+- (float) redGain
+{
+    return redGain;
+}
+
+- (void) setRedGain: (float) v
+{
+    redGain = v;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -570,21 +848,179 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
 
 
 //
-// Avoid subclassing this method if possible
-// Instead put functionality into [setIsocFrameFunctions]
-// and of course [startupGrabStream] and [shutdownGrabStream]
+// The chunk rings, see GenericChunkRing
+// Only one thread may put into a ring, taking is safe from anywhere
 //
-- (BOOL) setupGrabContext 
+static void chunkRingInit(GenericChunkRing * ring) 
 {
-    BOOL ok = YES;
-    int i, j;
+    ring->read = 0;
+    ring->write = 0;
+}
+
+static BOOL chunkRingSetup(GenericChunkRing * ring, int size) 
+{
+    int capacity = 1;
     
-    for (i = 0; i < GENERIC_MAX_TRANSFERS; i++) 
+    while (capacity < size) 
+        capacity *= 2;
+    
+    MALLOC(ring->chunks, volatile int32_t *, capacity * sizeof(int32_t), "chunk ring");
+    ring->mask = capacity - 1;
+    chunkRingInit(ring);
+    
+    return (ring->chunks != NULL) ? YES : NO;
+}
+
+static void chunkRingCleanup(GenericChunkRing * ring) 
+{
+    if (ring->chunks != NULL) 
+        FREE((void *) ring->chunks, "chunk ring");
+    ring->chunks = NULL;
+    chunkRingInit(ring);
+}
+
+static int chunkRingCount(GenericChunkRing * ring) 
+{
+    return ring->write - ring->read;
+}
+
+static void chunkRingPut(GenericChunkRing * ring, int chunk) 
+{
+    ring->chunks[ring->write & ring->mask] = chunk;
+    AtomicIncrement32(&ring->write);  // Publishes the chunk
+}
+
+//
+// Returns the oldest chunk, or -1 if there is none
+//
+static int chunkRingTake(GenericChunkRing * ring) 
+{
+    while (true) 
     {
-        grabContext.transferPointers[i].transferIndex = i;
-        grabContext.transferPointers[i].context = &grabContext;
+        int32_t read = ring->read;
+        int32_t write = ring->write;
+        AtomicBarrier();  // Read the chunk only after seeing it published
+        
+        if (read == write) 
+            return -1;
+        
+        int chunk = ring->chunks[read & ring->mask];
+        
+        if (AtomicCompareAndSwap32(&ring->read, read, read + 1)) 
+            return chunk;
+    }
+}
+
+//
+// Only for the USB callbacks: get an empty chunk to fill, or recycle the 
+// oldest full one if the decoder is behind. The decoder holds one chunk at 
+// a time, when it skips a stale one it gives that back before it takes the 
+// next, so with at least two there is always one to be found.
+// 
+// A lossless queue waits for the decoder instead, and gives up (returns -1) 
+// after GENERIC_BACKPRESSURE_TIMEOUT, or right away once grabbing stops. The 
+// caller then drops the chunk. The wait holds up the other completions on 
+// the grabbing thread's run loop, so the timeout is kept to a few frames.
+//
+static int takeEmptyChunk(GenericGrabContext * gCtx) 
+{
+    int chunk;
+    dispatch_time_t deadline = 0;
+    
+    while (true) 
+    {
+        chunk = chunkRingTake(&gCtx->emptyChunks);
+        if (chunk >= 0) 
+            break;
+        
+        if (gCtx->queuePolicy == queueLossless) 
+        {
+            // Stopping, the decoder won't give anything back any more
+            
+            if (!(*gCtx->shouldBeGrabbing)) 
+            {
+                AtomicCount32(&gCtx->statistics->backpressureDrops);
+                return -1;
+            }
+            
+            // One deadline per chunk, stale signals only cost another look at the ring
+            
+            if (deadline == 0) 
+            {
+                AtomicCount32(&gCtx->statistics->backpressureStalls);
+                deadline = dispatch_time(DISPATCH_TIME_NOW, GENERIC_BACKPRESSURE_TIMEOUT * NSEC_PER_MSEC);
+            }
+            
+            TRACE_BEGIN("backpressure", gCtx->traceCamera);
+            long timedOut = dispatch_semaphore_wait(gCtx->chunkFreed, deadline);
+            TRACE_END("backpressure", gCtx->traceCamera);
+            
+            if (timedOut == 0) 
+                continue;
+            
+            chunk = chunkRingTake(&gCtx->emptyChunks);  // One last look
+            if (chunk >= 0) 
+                break;
+            
+            AtomicCount32(&gCtx->statistics->backpressureDrops);
+            return -1;
+        }
+        
+        chunk = chunkRingTake(&gCtx->fullChunks);
+        if (chunk >= 0) 
+        {
+            AtomicCount32(&gCtx->statistics->queueOverflows);
+            break;
+        }
     }
     
+    gCtx->chunkStates[chunk] = chunkFilling;
+    
+    return chunk;
+}
+
+//
+// Shared decoding: all cameras decode on one pool of threads, as many as there 
+// are cores (GCD's, which also moves the work to whichever thread is free). 
+// Each camera has a serial queue on it, so its chunks still come out in order.
+//
+static dispatch_queue_t CreateSharedDecodeQueue(void) 
+{
+    dispatch_queue_t queue = dispatch_queue_create("macam.decode", NULL);
+    dispatch_set_target_queue(queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+    return queue;
+}
+
+static void DecodeQueuedChunks(void * driver) 
+{
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    [(GenericDriver *) driver decodeQueuedChunks];
+    [pool release];
+}
+
+static void DecodeQueueFlushed(void * unused) 
+{
+}
+
+static void queueFullChunk(GenericGrabContext * gCtx, int chunk) 
+{
+    gCtx->chunkStates[chunk] = chunkFull;
+    chunkRingPut(&gCtx->fullChunks, chunk);
+    
+    // Wake up the decoder, or have a pass scheduled unless one is still to come
+    
+    if (gCtx->decodeQueue == NULL) 
+        dispatch_semaphore_signal(gCtx->chunkReady);
+    else if (AtomicCompareAndSwap32(&gCtx->decodeScheduled, 0, 1)) 
+        dispatch_async_f(gCtx->decodeQueue, gCtx->decodeTarget, DecodeQueuedChunks);
+}
+
+//
+// Decide on the sizes of everything, but don't allocate anything yet
+// Avoid subclassing this method, put functionality into [setIsocFrameFunctions]
+//
+- (void) configureGrabContext 
+{
     if (driverType == isochronousDriver) 
     {
         grabContext.numberOfTransfers = GENERIC_NUM_TRANSFERS;
@@ -608,21 +1044,43 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
     
     [self setIsocFrameFunctions];  // can also adjust number of transfers, frames, buffers, buffer-sizes
     
-    if (grabContext.numberOfTransfers > GENERIC_MAX_TRANSFERS) 
-        grabContext.numberOfTransfers = GENERIC_MAX_TRANSFERS;
+    // The application knows best what it needs
     
-    if (grabContext.numberOfFramesPerTransfer > GENERIC_FRAMES_PER_TRANSFER) 
-        grabContext.numberOfFramesPerTransfer = GENERIC_FRAMES_PER_TRANSFER;
+    if (grabConfiguration.numberOfTransfers > 0) 
+        grabContext.numberOfTransfers = grabConfiguration.numberOfTransfers;
     
-    if (grabContext.numberOfChunkBuffers > GENERIC_MAX_CHUNK_BUFFERS) 
-        grabContext.numberOfChunkBuffers = GENERIC_MAX_CHUNK_BUFFERS;
+    if (grabConfiguration.numberOfFramesPerTransfer > 0 && driverType == isochronousDriver) 
+        grabContext.numberOfFramesPerTransfer = grabConfiguration.numberOfFramesPerTransfer;
     
-    // Clear things that have to be set back if init() fails
+    if (grabConfiguration.numberOfChunkBuffers > 0) 
+        grabContext.numberOfChunkBuffers = grabConfiguration.numberOfChunkBuffers;
     
-    grabContext.chunkListLock = NULL;
+    grabContext.numberOfTransfers = CLAMP(grabContext.numberOfTransfers, [self minimumNumberOfTransfers], GENERIC_MAX_TRANSFERS);
+    grabContext.numberOfFramesPerTransfer = CLAMP(grabContext.numberOfFramesPerTransfer, 1, GENERIC_MAX_FRAMES_PER_TRANSFER);
+    grabContext.numberOfChunkBuffers = CLAMP(grabContext.numberOfChunkBuffers, 2, GENERIC_MAX_CHUNK_BUFFERS);  // See takeEmptyChunk()
+}
+
+//
+// Avoid subclassing this method if possible
+// Instead put functionality into [setIsocFrameFunctions]
+// and of course [startupGrabStream] and [shutdownGrabStream]
+//
+- (BOOL) setupGrabContext 
+{
+    BOOL ok = YES;
+    int i, j;
     
-    for (i = 0; i < grabContext.numberOfTransfers; i++) 
-        grabContext.transferContexts[i].buffer = NULL;
+    [self configureGrabContext];
+    
+    // Clear things that have to be set back if init() fails
+    
+    grabContext.transferPointers = NULL;
+    grabContext.transferContexts = NULL;
+    grabContext.transferBuffers = NULL;
+    grabContext.chunkBuffers = NULL;
+    grabContext.chunkStates = NULL;
+    grabContext.emptyChunks.chunks = NULL;
+    grabContext.fullChunks.chunks = NULL;
     
     // Setup simple things
     
@@ -636,10 +1094,10 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
     grabContext.initiatedUntil = 0; // Will be set later (directly before start)
     grabContext.finishedTransfers = 0;
     grabContext.framesSinceLastChunk = 0;
-    
-    grabContext.numFullBuffers = 0;
-    grabContext.numEmptyBuffers = 0;
-    grabContext.fillingChunk = false;
+    grabContext.droppedFrames = 0;
+    grabContext.droppedChunks = 0;
+    grabContext.statistics = &statistics;
+    grabContext.fillingChunk = -1;
     
     grabContext.frameInfo.averageLuminance = 0;
     grabContext.frameInfo.averageLuminanceSet = 0;
@@ -652,21 +1110,52 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
     
     [agc setFrameInfo:&grabContext.frameInfo];
     
-    // Setup things that have to be set back if init fails
+    // Allocate the arrays, zeroed so a partial setup can be cleaned up
+    
+    MALLOC(grabContext.transferPointers, ContextAndIndex *, grabContext.numberOfTransfers * sizeof(ContextAndIndex), "transfer pointers");
+    MALLOC(grabContext.transferContexts, GenericTransferContext *, grabContext.numberOfTransfers * sizeof(GenericTransferContext), "transfer contexts");
+    MALLOC(grabContext.transferBuffers, GenericChunkBuffer *, grabContext.numberOfTransfers * sizeof(GenericChunkBuffer), "transfer buffers");
+    MALLOC(grabContext.chunkBuffers, GenericChunkBuffer *, grabContext.numberOfChunkBuffers * sizeof(GenericChunkBuffer), "chunk buffers");
+    MALLOC(grabContext.chunkStates, volatile GenericChunkState *, grabContext.numberOfChunkBuffers * sizeof(GenericChunkState), "chunk states");
+    
+    if (grabContext.transferPointers == NULL || grabContext.transferContexts == NULL || grabContext.transferBuffers == NULL || 
+        grabContext.chunkBuffers == NULL || grabContext.chunkStates == NULL) 
+        ok = NO;
     
     if (ok) 
     {
-        grabContext.chunkListLock = [[NSLock alloc] init];
-        if (grabContext.chunkListLock == NULL) 
-            ok = NO;
+        memset(grabContext.transferContexts, 0, grabContext.numberOfTransfers * sizeof(GenericTransferContext));
+        memset(grabContext.transferBuffers, 0, grabContext.numberOfTransfers * sizeof(GenericChunkBuffer));
+        memset(grabContext.chunkBuffers, 0, grabContext.numberOfChunkBuffers * sizeof(GenericChunkBuffer));
+        
+        for (i = 0; i < grabContext.numberOfTransfers; i++) 
+        {
+            grabContext.transferPointers[i].transferIndex = i;
+            grabContext.transferPointers[i].context = &grabContext;
+        }
     }
     
+    if (ok) 
+        ok = chunkRingSetup(&grabContext.emptyChunks, grabContext.numberOfChunkBuffers);
+    
+    if (ok) 
+        ok = chunkRingSetup(&grabContext.fullChunks, grabContext.numberOfChunkBuffers);
+    
     // Initialize transfer contexts
     
     if (ok) 
     {
         for (i = 0; ok && (i < grabContext.numberOfTransfers); i++) 
         {
+            MALLOC(grabContext.transferContexts[i].frameList, IOUSBIsocFrame *, 
+                   grabContext.numberOfFramesPerTransfer * sizeof(IOUSBIsocFrame), "isoc frame list");
+            
+            if (grabContext.transferContexts[i].frameList == NULL) 
+            {
+                ok = NO;
+                break;
+            }
+            
             for (j = 0; j < grabContext.numberOfFramesPerTransfer; j++) 
             {
                 grabContext.transferContexts[i].frameList[j].frStatus = 0;
@@ -674,8 +1163,7 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
                 grabContext.transferContexts[i].frameList[j].frActCount = 0;
             }
             
-            MALLOC(grabContext.transferContexts[i].buffer, UInt8 *,
-                   grabContext.numberOfFramesPerTransfer * grabContext.bytesPerFrame, "isoc transfer buffer");
+            grabContext.transferContexts[i].buffer = (UInt8 *) [arena bufferOfSize:grabContext.numberOfFramesPerTransfer * grabContext.bytesPerFrame];
             
             if (grabContext.transferContexts[i].buffer == NULL) 
                 ok = NO;
@@ -686,42 +1174,37 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
     
     for (i = 0; ok && (i < grabContext.numberOfTransfers); i++) 
     {
-        MALLOC(grabContext.transferBuffers[i].buffer, UInt8 *, grabContext.chunkBufferLength, "Chunk transfer buffer");
+        grabContext.transferBuffers[i].buffer = (UInt8 *) [arena bufferOfSize:grabContext.chunkBufferLength];
         
         if (grabContext.transferBuffers[i].buffer == NULL) 
             ok = NO;
-        else 
-		{
-            timerclear(&(grabContext.transferBuffers[i].tv));
-            timerclear(&(grabContext.transferBuffers[i].tvStart));
-            timerclear(&(grabContext.transferBuffers[i].tvDone));
-		}
     }
     
     for (i = 0; ok && (i < grabContext.numberOfChunkBuffers); i++) 
     {
-        MALLOC(grabContext.emptyChunkBuffers[i].buffer, UInt8 *, grabContext.chunkBufferLength, "Chunk buffer");
+        grabContext.chunkBuffers[i].buffer = (UInt8 *) [arena bufferOfSize:grabContext.chunkBufferLength];
         
-        if (grabContext.emptyChunkBuffers[i].buffer == NULL) 
+        if (grabContext.chunkBuffers[i].buffer == NULL) 
             ok = NO;
         else 
 		{
-            grabContext.numEmptyBuffers = i + 1;
-            timerclear(&(grabContext.emptyChunkBuffers[i].tv));
-            timerclear(&(grabContext.emptyChunkBuffers[i].tvStart));
-            timerclear(&(grabContext.emptyChunkBuffers[i].tvDone));
+            grabContext.chunkStates[i] = chunkEmpty;
+            chunkRingPut(&grabContext.emptyChunks, i);
 		}
     }
     
-    // Cleanup if anything went wrong
+    // Cleanup if anything went wrong, otherwise drop what the last grab had and this one didn't want
     
     if (!ok) 
     {
         NSLog(@"setupGrabContext failed");
         [self cleanupGrabContext];
     }
+    else 
+        [arena trim];
     
     grabContext.receiveFPS = receiveFPS;
+    grabContext.queuePolicy = queuePolicy;
     
     return ok;
 }
@@ -733,74 +1216,119 @@ int  genericIsocDataCopier(void * destination, const void * source, size_t lengt
 {
     int i;
     
-    // Cleanup chunk list lock
+    // Cleanup bulk and isoc buffers
     
-    if (grabContext.chunkListLock != NULL) 
+    if (grabContext.transferBuffers != NULL) 
     {
-        [grabContext.chunkListLock release];
-        grabContext.chunkListLock = NULL;
+        for (i = 0; i < grabContext.numberOfTransfers; i++) 
+            if (grabContext.transferBuffers[i].buffer) 
+                [arena recycleBuffer:grabContext.transferBuffers[i].buffer];
+        
+        FREE(grabContext.transferBuffers, "transfer buffers");
+        grabContext.transferBuffers = NULL;
     }
     
-    // Cleanup bulk buffers
-    
-    for (i = 0; i < grabContext.numberOfTransfers; i++) 
+    if (grabContext.transferContexts != NULL) 
     {
-        if (grabContext.transferBuffers[i].buffer) 
+        for (i = 0; i < grabContext.numberOfTransfers; i++) 
         {
-            FREE(grabContext.transferBuffers[i].buffer, "bulk data buffer");
-            grabContext.transferBuffers[i].buffer = NULL;
+            if (grabContext.transferContexts[i].buffer) 
+                [arena recycleBuffer:grabContext.transferContexts[i].buffer];
+            
+            if (grabContext.transferContexts[i].frameList) 
+                FREE(grabContext.transferContexts[i].frameList, "isoc frame list");
         }
+        
+        FREE(grabContext.transferContexts, "transfer contexts");
+        grabContext.transferContexts = NULL;
     }
     
-    // Cleanup isoc buffers
-    
-    for (i = 0; i < grabContext.numberOfTransfers; i++) 
+    if (grabContext.transferPointers != NULL) 
     {
-        if (grabContext.transferContexts[i].buffer) 
-        {
-            FREE(grabContext.transferContexts[i].buffer, "isoc data buffer");
-            grabContext.transferContexts[i].buffer = NULL;
-        }
+        FREE(grabContext.transferPointers, "transfer pointers");
+        grabContext.transferPointers = NULL;
     }
     
-    // Cleanup empty chunk buffers
+    // Cleanup chunk buffers, whatever state they are in (all threads are done by now)
     
-    for (i = grabContext.numEmptyBuffers - 1; i >= 0; i--) 
+    if (grabContext.chunkBuffers != NULL) 
     {
-        if (grabContext.emptyChunkBuffers[i].buffer != NULL) 
-        {
-            FREE(grabContext.emptyChunkBuffers[i].buffer, "empty chunk buffer");
-            grabContext.emptyChunkBuffers[i].buffer = NULL;
-        }
+        for (i = 0; i < grabContext.numberOfChunkBuffers; i++) 
+            if (grabContext.chunkBuffers[i].buffer != NULL) 
+                [arena recycleBuffer:grabContext.chunkBuffers[i].buffer];
+        
+        FREE(grabContext.chunkBuffers, "chunk buffers");
+        grabContext.chunkBuffers = NULL;
     }
     
-    grabContext.numEmptyBuffers = 0;
-    
-    // Cleanup full chunk buffers
-    
-    for (i = grabContext.numFullBuffers - 1; i >= 0; i--) 
+    if (grabContext.chunkStates != NULL) 
     {
-        if (grabContext.fullChunkBuffers[i].buffer != NULL) 
-        {
-            FREE(grabContext.fullChunkBuffers[i].buffer, "full chunk buffer");
-            grabContext.fullChunkBuffers[i].buffer = NULL;
-        }
+        FREE((void *) grabContext.chunkStates, "chunk states");
+        grabContext.chunkStates = NULL;
     }
     
-    grabContext.numFullBuffers = 0;
+    chunkRingCleanup(&grabContext.emptyChunks);
+    chunkRingCleanup(&grabContext.fullChunks);
+    grabContext.fillingChunk = -1;
+}
+
+//
+// Only the sizes, what the buffers are for is up to the driver
+//
+- (void) setGrabConfiguration:(GenericGrabConfiguration) configuration
+{
+    grabConfiguration = configuration;
+}
+
+
+- (GenericGrabConfiguration) grabConfiguration
+{
+    return grabConfiguration;
+}
+
+//
+// What the buffers of a grab cost in memory, and what they buy in latency 
+// (bad) and in tolerance for a decoder that can't keep up (good). While 
+// grabbing, or still shutting down, this describes the grab in progress. 
+// The context is only configured once the decoding thread is done with it 
+// (isGrabbing, not shouldBeGrabbing), and the lock keeps the next grab from 
+// starting meanwhile.
+//
+- (GenericGrabPlan) planGrab
+{
+    GenericGrabPlan plan;
+    long transferLength = 0;
     
-    // Cleanup filling chunk buffer
+    [stateLock lock];
     
-    if (grabContext.fillingChunk) 
-    {
-        if (grabContext.fillingChunkBuffer.buffer != NULL) 
-        {
-            FREE(grabContext.fillingChunkBuffer.buffer, "filling chunk buffer");
-            grabContext.fillingChunkBuffer.buffer = NULL;
-        }
-        
-        grabContext.fillingChunk = false;
-    }
+    if (!isGrabbing) 
+        [self configureGrabContext];
+    
+    if (driverType == isochronousDriver) 
+        transferLength = grabContext.numberOfFramesPerTransfer * [self usbGetIsocFrameSize];
+    
+    plan.numberOfTransfers = grabContext.numberOfTransfers;
+    plan.numberOfFramesPerTransfer = grabContext.numberOfFramesPerTransfer;
+    plan.numberOfChunkBuffers = grabContext.numberOfChunkBuffers;
+    plan.chunkBufferLength = grabContext.chunkBufferLength;
+    plan.memoryFootprint = grabContext.numberOfChunkBuffers * grabContext.chunkBufferLength + 
+                           grabContext.numberOfTransfers * (grabContext.chunkBufferLength + transferLength);
+    
+    plan.frameInterval = ([self fps] > 0) ? 1000.0f / [self fps] : 0.0f;
+    
+    // Isochronous data shows up when the whole transfer is done, a USB frame is a ms
+    
+    plan.transferLatency = (driverType == isochronousDriver) ? grabContext.numberOfFramesPerTransfer : 0.0f;
+    
+    // One chunk is always in the hands of the USB callbacks or the decoder, the rest can queue up
+    
+    plan.stallTolerance = (grabContext.numberOfChunkBuffers - 1) * plan.frameInterval;
+    plan.queueLatency = (queuePolicy == queueLatestOnly) ? plan.frameInterval : plan.stallTolerance;
+    plan.worstCaseLatency = plan.transferLatency + plan.queueLatency;
+    
+    [stateLock unlock];
+    
+    return plan;
 }
 
 //
@@ -819,10 +1347,10 @@ static void isocComplete(void * refcon, IOReturn result, void * arg0)
     short transferIdx = 0;
     bool frameListFound = false;
     UInt8 * frameBase;
+    UInt64 completionTicks = MonotonicTicks();
     int i;
     
-    static int droppedFrames = 0;
-    static int droppedChunks = 0;
+    TRACE_BEGIN("isocComplete", gCtx->traceCamera);
     
     // Handle result from isoc transfer
     
@@ -876,6 +1404,7 @@ static void isocComplete(void * refcon, IOReturn result, void * arg0)
         for (i = 0; i < gCtx->numberOfFramesPerTransfer; i++) // Let's have a look into the usb frames we got
         {
             UInt32 dataStart, dataLength, tailStart, tailLength;
+            GenericChunkBuffer * filling;
             
             frameBase = gCtx->transferContexts[transferIdx].buffer + gCtx->bytesPerFrame * i; // Is this right? It assumes possibly non-contiguous writing, if actual count < requested count [yes, seems to work, look at USB spec?]
             
@@ -884,93 +1413,84 @@ static void isocComplete(void * refcon, IOReturn result, void * arg0)
             
             if (frameResult == invalidFrame || myFrameList[i].frActCount == 0) 
             {
-                droppedFrames++;
+                gCtx->droppedFrames++;
+                AtomicCount32(&gCtx->statistics->invalidFrames);
             }
             else if (frameResult == invalidChunk) 
             {
-                droppedFrames = 0;
-                droppedChunks++;
-                gCtx->fillingChunkBuffer.numBytes = 0;
+                gCtx->droppedFrames = 0;
+                gCtx->droppedChunks++;
+                if (gCtx->fillingChunk >= 0) 
+                    gCtx->chunkBuffers[gCtx->fillingChunk].numBytes = 0;
+                AtomicCount32(&gCtx->statistics->invalidChunks);
             }
             else if (frameResult == newChunkFrame) 
             {
-                droppedFrames = 0;
-                droppedChunks = 0;
+                gCtx->droppedFrames = 0;
+                gCtx->droppedChunks = 0;
                 
                 // When the new chunk starts in the middle of a frame, we must copy the tail to the old chunk
                 
-                if (gCtx->fillingChunk && tailLength > 0) 
+                if (gCtx->fillingChunk >= 0 && tailLength > 0) 
                 {
-                    int add = (*gCtx->isocDataCopier)(gCtx->fillingChunkBuffer.buffer + gCtx->fillingChunkBuffer.numBytes, frameBase + tailStart, tailLength, gCtx->chunkBufferLength - gCtx->fillingChunkBuffer.numBytes);
-                    gCtx->fillingChunkBuffer.numBytes += add;
+                    filling = &gCtx->chunkBuffers[gCtx->fillingChunk];
+                    int add = (*gCtx->isocDataCopier)(filling->buffer + filling->numBytes, frameBase + tailStart, tailLength, gCtx->chunkBufferLength - filling->numBytes);
+                    filling->numBytes += add;
                 }
                 
-                // Now we need to get a new chunk
-                // Wait for access to the chunk buffers
-                
-                [gCtx->chunkListLock lock];
-                
                 // We were filling, first deal with the old chunk that is now full
                 
-                if (gCtx->fillingChunk) 
+                if (gCtx->fillingChunk >= 0) 
                 {
-                    int j;
+                    filling = &gCtx->chunkBuffers[gCtx->fillingChunk];
                     
-//                  printf("Chunk filled with %ld bytes\n", gCtx->fillingChunkBuffer.numBytes);
+//                  printf("Chunk filled with %ld bytes\n", filling->numBytes);
                     
-					gettimeofday(&gCtx->fillingChunkBuffer.tvDone, NULL); // set the time of the buffer
+					gettimeofday(&filling->tvDone, NULL); // set the time of the buffer
+					filling->usbTicks = completionTicks;
+					filling->fullTicks = MonotonicTicks();
 					[gCtx->receiveFPS addFrame];
+					TRACE_INSTANT("chunk queued", gCtx->traceCamera, filling->numBytes);
+					AtomicCount32(&gCtx->statistics->receivedChunks);
                     
-                    // Pass the complete chunk to the full list
-                    // Move full buffers one up
-                    
-                    for (j = gCtx->numFullBuffers - 1; j >= 0; j--) 
-                        gCtx->fullChunkBuffers[j + 1] = gCtx->fullChunkBuffers[j];
+                    // Pass the complete chunk on to the decoder
                     
-                    gCtx->fullChunkBuffers[0] = gCtx->fillingChunkBuffer; // Insert the filling one as newest
-                    gCtx->numFullBuffers++;				// We have inserted one buffer
-                                                        //  What if the list was already full? - That is not possible
-                    gCtx->fillingChunk = false;			// Now we're not filling (still in the lock to be sure no buffer is lost)
+                    queueFullChunk(gCtx, gCtx->fillingChunk);
+                    gCtx->fillingChunk = -1;
                     gCtx->framesSinceLastChunk = 0;     // Reset watchdog
                 } 
                 // else // There was no current filling chunk. Just get a new one.
                 
-                // We still have the list access lock. Get a new buffer to fill.
+                // Get a new buffer to fill
                 
-                if (gCtx->numEmptyBuffers > 0) 			// There's an empty buffer to use
-                {
-                    gCtx->numEmptyBuffers--;
-                    gCtx->fillingChunkBuffer = gCtx->emptyChunkBuffers[gCtx->numEmptyBuffers];
-                } 
-                else // No empty buffer: discard a full one (there are enough, both lists can't be empty)
-                {
-                    gCtx->numFullBuffers--;             // Use the oldest one
-                    gCtx->fillingChunkBuffer = gCtx->fullChunkBuffers[gCtx->numFullBuffers];
-                }
-                gCtx->fillingChunk = true;				// Now we're filling (still in the lock to be sure no buffer is lost)
-                gCtx->fillingChunkBuffer.numBytes = 0;	// Start with empty buffer
+                gCtx->fillingChunk = takeEmptyChunk(gCtx);
                 
-                if (gCtx->headerLength > 0) 
+                if (gCtx->fillingChunk >= 0) // Otherwise the data is dropped until the next chunk starts
                 {
-                    int add = (*gCtx->isocDataCopier)(gCtx->fillingChunkBuffer.buffer + gCtx->fillingChunkBuffer.numBytes, 
-                                                      gCtx->headerData, gCtx->headerLength, gCtx->chunkBufferLength - gCtx->fillingChunkBuffer.numBytes);
-                    gCtx->fillingChunkBuffer.numBytes += add;
+                    filling = &gCtx->chunkBuffers[gCtx->fillingChunk];
+                    filling->numBytes = 0;	// Start with empty buffer
+                    
+                    if (gCtx->headerLength > 0) 
+                    {
+                        int add = (*gCtx->isocDataCopier)(filling->buffer + filling->numBytes, 
+                                                          gCtx->headerData, gCtx->headerLength, gCtx->chunkBufferLength - filling->numBytes);
+                        filling->numBytes += add;
+                    }
+                    
+                    gettimeofday(&filling->tvStart, NULL); // set the time of the buffer
+                    filling->tv = filling->tvStart;
                 }
-                
-                [gCtx->chunkListLock unlock];			// Free access to the chunk buffers
-				
-				gettimeofday(&gCtx->fillingChunkBuffer.tvStart, NULL); // set the time of the buffer
-                gCtx->fillingChunkBuffer.tv = gCtx->fillingChunkBuffer.tvStart;
             }
             // else // validFrame 
             
-            if (gCtx->fillingChunk && (dataLength > 0)) 
+            // The filling chunk belongs to us alone, no need to lock
+            
+            if (gCtx->fillingChunk >= 0 && (dataLength > 0)) 
             {
-                [gCtx->chunkListLock lock];
-                int add = (*gCtx->isocDataCopier)(gCtx->fillingChunkBuffer.buffer + gCtx->fillingChunkBuffer.numBytes, 
-                                                  frameBase + dataStart, dataLength, gCtx->chunkBufferLength - gCtx->fillingChunkBuffer.numBytes);
-                gCtx->fillingChunkBuffer.numBytes += add;
-                [gCtx->chunkListLock unlock];
+                filling = &gCtx->chunkBuffers[gCtx->fillingChunk];
+                int add = (*gCtx->isocDataCopier)(filling->buffer + filling->numBytes, 
+                                                  frameBase + dataStart, dataLength, gCtx->chunkBufferLength - filling->numBytes);
+                filling->numBytes += add;
             }
         }
         
@@ -978,7 +1498,7 @@ static void isocComplete(void * refcon, IOReturn result, void * arg0)
         
         if (gCtx->framesSinceLastChunk > gCtx->maxFramesBetweenChunks) // Too long without a frame? Something is wrong. 
         {
-            NSLog(@"GenericDriver: grab aborted because of invalid data stream (too long without a frame, %i invalid frames, %i invalid chunks)", droppedFrames, droppedChunks);
+            NSLog(@"GenericDriver: grab aborted because of invalid data stream (too long without a frame, %i invalid frames, %i invalid chunks)", gCtx->droppedFrames, gCtx->droppedChunks);
             *gCtx->shouldBeGrabbing = NO;
             if (gCtx->contextError == CameraErrorOK) 
                 gCtx->contextError = CameraErrorUSBProblem;
@@ -997,11 +1517,13 @@ static void isocComplete(void * refcon, IOReturn result, void * arg0)
     
     if (!(*gCtx->shouldBeGrabbing)) 
     {
-        droppedFrames = 0;
+        gCtx->droppedFrames = 0;
         gCtx->finishedTransfers++;
         if (gCtx->finishedTransfers >= gCtx->numberOfTransfers) 
             CFRunLoopStop(CFRunLoopGetCurrent());
     }
+    
+    TRACE_END("isocComplete", gCtx->traceCamera);
 }
 
 //
@@ -1047,6 +1569,9 @@ static void bulkComplete(void * refcon, IOReturn result, void * arg0)
     GenericGrabContext * gCtx = (GenericGrabContext *) ref->context;
     short transferIdx = ref->transferIndex;
     UInt32 bytesReceived = (UInt32) arg0;
+    UInt64 completionTicks = MonotonicTicks();
+    
+    TRACE_BEGIN_ARG("bulkComplete", gCtx->traceCamera, bytesReceived);
     
     // Handle result from bulk transfer
     
@@ -1077,56 +1602,39 @@ static void bulkComplete(void * refcon, IOReturn result, void * arg0)
     
     if (*gCtx->shouldBeGrabbing && bytesReceived > 0) 
     {
-        int j;
-        GenericChunkBuffer chunk;
+        int index;
+        GenericChunkBuffer * chunk;
         unsigned char * savePointer;
         
-        // Now we need to get a new chunk
-        // Wait for access to the chunk buffers
-        
-        [gCtx->chunkListLock lock];
-        
         // First get a chunk
         // Switch the buffers
-        // Put it in the full list
+        // Put it in the full ring
         
-        // We have the list access lock. Get a new buffer to fill.
+        index = takeEmptyChunk(gCtx);
         
-        if (gCtx->numFullBuffers == GENERIC_MAX_CHUNK_BUFFERS ||
-            gCtx->numEmptyBuffers == 0) 
-        {
-            gCtx->numFullBuffers--;  // Use the oldest one
-            chunk = gCtx->fullChunkBuffers[gCtx->numFullBuffers];
-        }
-        else  // There's an empty buffer to use
+        if (index >= 0) // Otherwise a lossless queue gave up, the transfer buffer is simply reused
         {
-            gCtx->numEmptyBuffers--;
-            chunk = gCtx->emptyChunkBuffers[gCtx->numEmptyBuffers];
-        }
+            chunk = &gCtx->chunkBuffers[index];
         
-        chunk.numBytes = bytesReceived;
-        gettimeofday(&chunk.tvStart, NULL); // set the time of the buffer
-        chunk.tv = chunk.tvDone = chunk.tvStart;
-        [gCtx->receiveFPS addFrame];
+            chunk->numBytes = bytesReceived;
+            gettimeofday(&chunk->tvStart, NULL); // set the time of the buffer
+            chunk->tv = chunk->tvDone = chunk->tvStart;
+            chunk->usbTicks = completionTicks;
+            chunk->fullTicks = MonotonicTicks();
+            [gCtx->receiveFPS addFrame];
+            TRACE_INSTANT("chunk queued", gCtx->traceCamera, bytesReceived);
+            AtomicCount32(&gCtx->statistics->receivedChunks);
         
-        // Pass the complete chunk to the full list
-        // Move full buffers one up
+            // Switch the pointers around
         
-        for (j = gCtx->numFullBuffers - 1; j >= 0; j--) 
-            gCtx->fullChunkBuffers[j + 1] = gCtx->fullChunkBuffers[j];
+            savePointer = chunk->buffer;
+            chunk->buffer = gCtx->transferBuffers[transferIdx].buffer;
+            gCtx->transferBuffers[transferIdx].buffer = savePointer;
         
-        // Switch the pointers around
+            // We have a new full buffer
         
-        savePointer = chunk.buffer;
-        chunk.buffer = gCtx->transferBuffers[transferIdx].buffer;
-        gCtx->transferBuffers[transferIdx].buffer = savePointer;
-        
-        // We have anew full buffer
-        
-        gCtx->fullChunkBuffers[0] = chunk;  // Insert the filling one as newest
-        gCtx->numFullBuffers++;				// We have inserted one buffer
-        
-        [gCtx->chunkListLock unlock];		// Free access to the chunk buffers
+            queueFullChunk(gCtx, index);
+        }
     }
     
     // Initiate next transfer
@@ -1145,6 +1653,8 @@ static void bulkComplete(void * refcon, IOReturn result, void * arg0)
         if (gCtx->finishedTransfers >= gCtx->numberOfTransfers) 
             CFRunLoopStop(CFRunLoopGetCurrent());
     }
+    
+    TRACE_END("bulkComplete", gCtx->traceCamera);
 }
 
 
@@ -1183,6 +1693,8 @@ static bool startNextBulkRead(GenericGrabContext * gCtx, int transferIdx)
 - (void) grabbingThread:(id) data 
 {
     NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    
+    PipelineTraceNameThread("grabbing");
     CFRunLoopSourceRef cfSource;
     IOReturn error;
     BOOL ok = YES;
@@ -1264,6 +1776,11 @@ static bool startNextBulkRead(GenericGrabContext * gCtx, int transferIdx)
     
     [pool release];
     grabbingThreadRunning = NO;
+    
+    // Every way of stopping ends up here, so this is where the decoder hears about it
+    
+    dispatch_semaphore_signal(grabContext.chunkReady);
+    dispatch_semaphore_signal(grabbingThreadFinished);
     [NSThread exit];
 }
 
@@ -1618,6 +2135,123 @@ static bool startNextBulkRead(GenericGrabContext * gCtx, int transferIdx)
     SequenceDecoding.sequenceIdentifier = 0;
 }
 
+//
+// Decode what is queued, oldest first. On the decoding thread, or with shared 
+// decoding on the camera's serial queue, so one chunk at a time either way.
+//
+- (void) decodeQueuedChunks 
+{
+    int chunk;
+    
+    // Chunks queued from here on schedule another pass
+    
+    if (grabContext.decodeQueue != NULL) 
+        AtomicExchange32(&grabContext.decodeScheduled, 0);
+    
+    while (shouldBeGrabbing && (chunk = chunkRingTake(&grabContext.fullChunks)) >= 0)  // Grab oldest
+    {
+        GenericChunkBuffer * currentBuffer;  // The buffer to decode
+        
+        grabContext.chunkStates[chunk] = chunkDecoding;
+        
+        // Only the newest chunk is worth decoding, give the others back right away. 
+        // The stale one goes back before the newer one is taken, so the callbacks 
+        // always have a chunk to fill
+        
+        while (grabContext.queuePolicy == queueLatestOnly && chunkRingCount(&grabContext.fullChunks) > 0) 
+        {
+            grabContext.chunkStates[chunk] = chunkEmpty;
+            chunkRingPut(&grabContext.emptyChunks, chunk);
+            dispatch_semaphore_signal(grabContext.chunkFreed);
+            AtomicCount32(&statistics.staleChunks);
+            
+            chunk = chunkRingTake(&grabContext.fullChunks);
+            if (chunk < 0) 
+                break;  // The callbacks recycled it meanwhile
+            grabContext.chunkStates[chunk] = chunkDecoding;
+        }
+        
+        if (chunk < 0) 
+            continue;
+        
+        currentBuffer = &grabContext.chunkBuffers[chunk];
+        
+        TRACE_INSTANT("chunk taken", grabContext.traceCamera, chunkRingCount(&grabContext.fullChunks));
+        
+        // Do the decoding
+        
+        if (nextImageBufferSet) 
+        {
+            BOOL decodingOK = NO;
+            UInt64 decodeStart = 0, decodeEnd = 0;
+            
+            [imageBufferLock lock]; // Lock image buffer access
+            
+            if (nextImageBuffer != NULL) 
+            {
+                TRACE_BEGIN("decodeBuffer", grabContext.traceCamera);
+                decodeStart = MonotonicTicks();
+                decodingOK = [self decodeBuffer:currentBuffer]; // Into nextImageBuffer
+                decodeEnd = MonotonicTicks();
+                TRACE_END("decodeBuffer", grabContext.traceCamera);
+            }
+            
+            if (decodingOK) 
+            {
+                lastImageBuffer = nextImageBuffer; // Copy nextBuffer info into lastBuffer
+                lastImageBufferBPP = nextImageBufferBPP;
+                lastImageBufferRowBytes = nextImageBufferRowBytes;
+                
+                lastImageBufferTimeVal = currentBuffer->tv;
+                
+                lastImageStamps[latencyUsbComplete] = currentBuffer->usbTicks;
+                lastImageStamps[latencyChunkFull] = currentBuffer->fullTicks;
+                lastImageStamps[latencyDecodeStart] = decodeStart;
+                lastImageStamps[latencyDecodeEnd] = decodeEnd;
+                lastImageStamps[latencyDelivered] = 0;
+                lastImageStamps[latencyPickedUp] = 0;
+                
+                nextImageBufferSet = NO;  // nextBuffer has been eaten up
+            }
+            else if (nextImageBuffer != NULL) 
+                AtomicCount32(&statistics.decoderRejects);
+            
+            [imageBufferLock unlock]; // Release lock
+            
+            if (decodingOK) 
+            {
+                lastImageStamps[latencyDelivered] = MonotonicTicks();
+                [latency recordStamps:lastImageStamps from:latencyUsbComplete to:latencyDelivered];
+                
+                TRACE_BEGIN("imageReady", grabContext.traceCamera);
+                [self mergeImageReady];   // Notify delegate about the image. Perhaps get a new buffer
+                TRACE_END("imageReady", grabContext.traceCamera);
+            }
+        }
+        else 
+        {
+            AtomicCount32(&statistics.undecodedChunks);
+            
+            // Keep the exposure up to date anyway, as long as it costs the decoding thread little
+            
+            if (([self isAutoGain] || [awb isEnabled]) && agcThreadRunning) 
+            {
+                TRACE_BEGIN("sampleChunk", grabContext.traceCamera);
+                if ([self sampleChunkStatistics:currentBuffer]) 
+                    [self postAgcSnapshot];
+                TRACE_END("sampleChunk", grabContext.traceCamera);
+            }
+        }
+        
+        // Put the chunk buffer back to the empty ones
+        
+        grabContext.chunkStates[chunk] = chunkEmpty;
+        chunkRingPut(&grabContext.emptyChunks, chunk);
+        dispatch_semaphore_signal(grabContext.chunkFreed);  // In case the USB callbacks are waiting
+    }
+}
+
+
 //
 // Avoid subclassing this method if possible
 // Instead put functionality into [decodeBuffer]
@@ -1625,8 +2259,11 @@ static bool startNextBulkRead(GenericGrabContext * gCtx, int transferIdx)
 - (CameraError) decodingThread 
 {
     CameraError error = CameraErrorOK;
+    BOOL grabbingThreadStarted = NO;
     grabbingThreadRunning = NO;
     
+    PipelineTraceNameThread("decoding");
+    
     // Try to get as much bandwidth as possible somehow?
     
     if (shouldBeGrabbing && ![self setGrabInterfacePipe]) 
@@ -1651,87 +2288,58 @@ static bool startNextBulkRead(GenericGrabContext * gCtx, int transferIdx)
         shouldBeGrabbing = NO;
     }
     
+    // Shared decoding: this camera's chunks go through a serial queue of its 
+    // own, on the pool all cameras share
+    
+    grabContext.decodeScheduled = 0;
+    grabContext.decodeTarget = self;
+    grabContext.decodeQueue = NULL;
+    if (shouldBeGrabbing && sharedDecoding) 
+        grabContext.decodeQueue = CreateSharedDecodeQueue();
+    
     // Start the grabbing thread
     
     if (shouldBeGrabbing) 
     {
         grabbingThreadRunning = YES;
+        grabbingThreadStarted = YES;
         [NSThread detachNewThreadSelector:@selector(grabbingThread:) toTarget:self withObject:NULL];
     }
     
-    // The decoding loop
+    // Exposure control runs on its own thread, so it never holds up decoding
+    
+    if (shouldBeGrabbing) 
+        [self startAgcThread];
+    
+    // The decoding loop. Shared decoding leaves it to the camera's queue, this 
+    // thread then only waits for the grabbing thread to stop
     
     while (shouldBeGrabbing) 
     {
-        if (grabContext.numFullBuffers == 0) 
-            usleep(1000); // 1 ms (1000 micro-seconds)
+        // Sleep until a chunk is queued, or the grabbing thread has stopped
+        // Left-over signals (chunks already taken by an earlier pass) just mean an empty pass
         
-        while (shouldBeGrabbing && (grabContext.numFullBuffers > 0)) 
-        {
-//            int j;
-            GenericChunkBuffer currentBuffer;   // The buffer to decode
-            
-            // Get a full buffer
-            
-            [grabContext.chunkListLock lock];   // Get access to the buffer lists
-            grabContext.numFullBuffers--;       // There's always one since no one else can empty it completely
-            
-            currentBuffer = grabContext.fullChunkBuffers[grabContext.numFullBuffers];  // Grab oldest
-            
-//            currentBuffer = grabContext.fullChunkBuffers[0];  // Grab newest
-//            for (j = 0; j < grabContext.numFullBuffers; j++) 
-//                grabContext.fullChunkBuffers[j] = grabContext.fullChunkBuffers[j + 1];
-            
-            [grabContext.chunkListLock unlock]; // Release access to the buffer lists
-            
-            // Do the decoding
-            
-            if (nextImageBufferSet) 
-            {
-                BOOL decodingOK = NO;
-                
-                [imageBufferLock lock]; // Lock image buffer access
-                
-                if (nextImageBuffer != NULL) 
-                {
-                    // decode start time
-                    decodingOK = [self decodeBuffer:&currentBuffer]; // Into nextImageBuffer
-                    // decode end time
-                }
-                
-                if (decodingOK) 
-                {
-                    lastImageBuffer = nextImageBuffer; // Copy nextBuffer info into lastBuffer
-                    lastImageBufferBPP = nextImageBufferBPP;
-                    lastImageBufferRowBytes = nextImageBufferRowBytes;
-                    
-                    lastImageBufferTimeVal = currentBuffer.tv;
-                    
-                    nextImageBufferSet = NO;  // nextBuffer has been eaten up
-                }
-                
-                [imageBufferLock unlock]; // Release lock
-                
-                if (decodingOK) 
-                    [self mergeImageReady];   // Notify delegate about the image. Perhaps get a new buffer
-            }
-            
-            // Put the chunk buffer back to the empty ones
-            
-            [grabContext.chunkListLock lock];   // Get access to the buffer lists
-            grabContext.emptyChunkBuffers[grabContext.numEmptyBuffers] = currentBuffer;
-            grabContext.numEmptyBuffers++;
-            [grabContext.chunkListLock unlock]; // Release access to the buffer lists            
-        }
+        dispatch_semaphore_wait(grabContext.chunkReady, DISPATCH_TIME_FOREVER);
+        
+        if (grabContext.decodeQueue == NULL) 
+            [self decodeQueuedChunks];
     }
     
     // Shutdown, but wait for grabbingThread finish first
     
-    while (grabbingThreadRunning) 
+    if (grabbingThreadStarted) 
+        dispatch_semaphore_wait(grabbingThreadFinished, DISPATCH_TIME_FOREVER);
+    
+    // Nothing gets queued any more, let the last pass finish
+    
+    if (grabContext.decodeQueue != NULL) 
     {
-        usleep(10000); // Sleep for 10 ms, then try again
+        dispatch_sync_f(grabContext.decodeQueue, NULL, DecodeQueueFlushed);
+        dispatch_release(grabContext.decodeQueue);
+        grabContext.decodeQueue = NULL;
     }
     
+    [self stopAgcThread];
     [self cleanupGrabContext];
     [self cleanupDecoding];
     
@@ -1742,6 +2350,103 @@ static bool startNextBulkRead(GenericGrabContext * gCtx, int transferIdx)
 }
 
 
+//
+// The AGC thread waits for histogram snapshots from the decoding thread and 
+// does the (slow) register writes, for the AWB as well. Only the latest 
+// snapshot matters, a newer one replaces one not picked up yet. The snapshot 
+// has its own lock, only held to copy it, so the metering settings and new 
+// snapshots don't wait for the register writes. The condition only carries 
+// the "there is one" flag.
+//
+- (void) agcThread:(id)data
+{
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    
+    ChangeMyThreadPriority(-10);  // Exposure can wait a little, frames can't
+    PipelineTraceNameThread("agc");
+    
+    [agcCondition lock];
+    
+    while (agcThreadShouldBeRunning) 
+    {
+        if (!agcSnapshotReady) 
+        {
+            [agcCondition wait];
+            continue;
+        }
+        
+        agcSnapshotReady = NO;
+        [agcCondition unlock];
+        
+        [agcSnapshotLock lock];
+        [agcWorking copyMeteringFrom:agcSnapshot];
+        [agcWorking copyZonesFrom:agcSnapshot];
+        [agcSnapshotLock unlock];
+        
+        TRACE_BEGIN("agc", grabContext.traceCamera);
+        
+        if ([self isAutoGain]) 
+            [agc update:agcWorking];
+        
+        [awb update:agcWorking];
+        
+        TRACE_END("agc", grabContext.traceCamera);
+        
+        [agcCondition lock];
+    }
+    
+    agcThreadRunning = NO;
+    [agcCondition broadcast];  // stopAgcThread is waiting for this
+    [agcCondition unlock];
+    
+    [pool release];
+}
+
+
+- (void) startAgcThread
+{
+    agcSnapshotReady = NO;
+    agcThreadShouldBeRunning = YES;
+    agcThreadRunning = YES;
+    
+    [NSThread detachNewThreadSelector:@selector(agcThread:) toTarget:self withObject:NULL];
+}
+
+
+- (void) stopAgcThread
+{
+    [agcCondition lock];
+    agcThreadShouldBeRunning = NO;
+    [agcCondition broadcast];
+    
+    while (agcThreadRunning) 
+        [agcCondition wait];
+    
+    [agcCondition unlock];
+}
+
+//
+// Called from the decoding thread, must never wait for the AGC thread. The 
+// condition lock is only ever held for a few instructions.
+//
+- (void) postAgcSnapshot
+{
+    if ([agc mode] == agcNone && ![awb isEnabled]) 
+        return;
+    
+    if (![agcSnapshotLock tryLock]) 
+        return;  // Busy with the settings or the previous snapshot, it's only for a moment
+    
+    [agcSnapshot copyZonesFrom:histogram];
+    [agcSnapshotLock unlock];
+    
+    [agcCondition lock];
+    agcSnapshotReady = YES;
+    [agcCondition signal];
+    [agcCondition unlock];
+}
+
+
 - (UInt8) getButtonPipe
 {
     return 2;
@@ -2052,8 +2757,22 @@ void BufferProviderRelease(void * info, const void * data, size_t size)
     {
         [histogram setupBuffer:nextImageBuffer rowBytes:nextImageBufferRowBytes bytesPerPixel:nextImageBufferBPP];  // store (pointers to) data
         
-        if ([self isAutoGain]) 
-            [agc update:histogram];  // update histogram if necessary, compute agc
+        if ([self isAutoGain] || [awb isEnabled]) 
+        {
+            if (agcThreadRunning && [histogram hasZones]) 
+                [self postAgcSnapshot];  // The AGC thread takes it from here
+            else 
+            {
+                TRACE_BEGIN("agc", grabContext.traceCamera);
+                
+                if ([self isAutoGain]) 
+                    [agc update:histogram];  // update histogram if necessary, compute agc
+                
+                [awb update:histogram];
+                
+                TRACE_END("agc", grabContext.traceCamera);
+            }
+        }
         
         [histogram draw];  // update histogram if necessary, draw in view already specified
     }
@@ -10,6 +10,7 @@
 #import "Histogram.h"
 
 #include <unistd.h>
+#include <math.h>
 
 
 @implementation Histogram
@@ -40,6 +41,23 @@
     low = 0;
     height = 0;
     
+    zoneWidth = 1;
+    zoneHeight = 1;
+    zonesAvailable = NO;
+    newZones = NO;
+    metered = -1;
+    [self resetZones];
+    
+    chromaSumU = 0;
+    chromaSumV = 0;
+    chromaAvailable = NO;
+    
+    int i;
+    for (i = 0; i < HISTOGRAM_NUM_ZONES; i++) 
+        meteringMask[i] = 1.0f;
+    
+    [self setMeteringMode:meteringAverage];
+    
     return self;
 }
 
@@ -73,6 +91,19 @@
 {
     width = newWidth;
     height = newHeight;
+    
+    zoneWidth = width / HISTOGRAM_ZONE_COLUMNS;
+    zoneHeight = height / HISTOGRAM_ZONE_ROWS;
+    
+    if (zoneWidth < 1) 
+        zoneWidth = 1;
+    
+    if (zoneHeight < 1) 
+        zoneHeight = 1;
+    
+    zonesAvailable = NO;
+    newZones = NO;
+    chromaAvailable = NO;
 }
 
 
@@ -140,6 +171,228 @@
 }
 
 
+//
+// The decoder calls [resetZones] before a frame, adds the luminance of every pixel 
+// to the zone sums of its row, and calls [finishZones] when the frame is done. 
+// The image width and height should be multiples of the zone grid.
+//
+- (void) resetZones
+{
+    int i;
+    
+    for (i = 0; i < HISTOGRAM_NUM_ZONES; i++) 
+        zoneSum[i] = 0;
+}
+
+
+- (UInt32 *) zoneSumsForRow:(int)row
+{
+    int zoneRow = row / zoneHeight;
+    
+    if (zoneRow >= HISTOGRAM_ZONE_ROWS) 
+        zoneRow = HISTOGRAM_ZONE_ROWS - 1;
+    
+    return zoneSum + zoneRow * HISTOGRAM_ZONE_COLUMNS;
+}
+
+
+- (int) zoneWidth
+{
+    return zoneWidth;
+}
+
+
+- (void) finishZones
+{
+    zonesAvailable = YES;
+    newZones = YES;
+}
+
+
+//
+// Take over the zones of another histogram, so they can be processed elsewhere
+//
+- (void) copyZonesFrom:(Histogram *)other
+{
+    memcpy(zoneSum, other->zoneSum, sizeof(zoneSum));
+    zoneWidth = other->zoneWidth;
+    zoneHeight = other->zoneHeight;
+    
+    chromaSumU = other->chromaSumU;
+    chromaSumV = other->chromaSumV;
+    chromaAvailable = other->chromaAvailable;
+    
+    [self finishZones];
+}
+
+
+- (BOOL) hasZones
+{
+    return zonesAvailable;
+}
+
+
+- (BOOL) processZones
+{
+    int i;
+    int pixels = zoneWidth * zoneHeight;
+    float weighted = 0.0f;
+    
+    if (!newZones) 
+        return NO;
+    
+    for (i = 0; i < HISTOGRAM_NUM_ZONES; i++) 
+    {
+        zoneMean[i] = zoneSum[i] / pixels;
+        weighted += meteringWeight[i] * zoneMean[i];
+    }
+    
+    metered = (int) (weighted / meteringWeightTotal + 0.5f);
+    newZones = NO;
+    
+    return YES;
+}
+
+
+- (const int *) getZoneMeans
+{
+    return zoneMean;
+}
+
+
+- (int) getAverageLuminance
+{
+    int i;
+    UInt32 sum = 0;
+    
+    for (i = 0; i < HISTOGRAM_NUM_ZONES; i++) 
+        sum += zoneSum[i];
+    
+    return sum / (HISTOGRAM_NUM_ZONES * zoneWidth * zoneHeight);
+}
+
+
+//
+// YUV decoders can also provide the sums of U and V over the same area as 
+// the zones (one U and V for every two pixels), for white balance
+//
+- (void) setChromaSumU:(UInt32)u v:(UInt32)v
+{
+    chromaSumU = u;
+    chromaSumV = v;
+    chromaAvailable = YES;
+}
+
+
+- (BOOL) hasChroma
+{
+    return chromaAvailable;
+}
+
+
+- (float) getAverageU
+{
+    return chromaSumU / (HISTOGRAM_NUM_ZONES * zoneWidth * zoneHeight / 2.0f);
+}
+
+
+- (float) getAverageV
+{
+    return chromaSumV / (HISTOGRAM_NUM_ZONES * zoneWidth * zoneHeight / 2.0f);
+}
+
+
+//
+// Center-weighted falls off smoothly from the middle of the image, spot only 
+// looks at the central 4x4 zones, and mask uses whatever weights were given.
+//
+- (void) setMeteringMode:(MeteringMode)mode
+{
+    int i, j;
+    
+    meteringMode = mode;
+    meteringWeightTotal = 0.0f;
+    
+    for (j = 0; j < HISTOGRAM_ZONE_ROWS; j++) 
+        for (i = 0; i < HISTOGRAM_ZONE_COLUMNS; i++) 
+        {
+            float dx = (i + 0.5f) / HISTOGRAM_ZONE_COLUMNS - 0.5f;
+            float dy = (j + 0.5f) / HISTOGRAM_ZONE_ROWS - 0.5f;
+            float w;
+            
+            switch (mode) 
+            {
+                case meteringCenterWeighted:
+                    w = expf(-(dx * dx + dy * dy) / (2 * 0.2f * 0.2f));
+                    break;
+                    
+                case meteringSpot:
+                    w = (fabsf(dx) < 0.13f && fabsf(dy) < 0.13f) ? 1.0f : 0.0f;
+                    break;
+                    
+                case meteringMask:
+                    w = meteringMask[j * HISTOGRAM_ZONE_COLUMNS + i];
+                    break;
+                    
+                case meteringAverage:
+                default:
+                    w = 1.0f;
+                    break;
+            }
+            
+            meteringWeight[j * HISTOGRAM_ZONE_COLUMNS + i] = w;
+            meteringWeightTotal += w;
+        }
+    
+    if (meteringWeightTotal <= 0.0f)  // An empty mask, fall back to the average
+    {
+        for (i = 0; i < HISTOGRAM_NUM_ZONES; i++) 
+            meteringWeight[i] = 1.0f;
+        
+        meteringWeightTotal = HISTOGRAM_NUM_ZONES;
+    }
+}
+
+
+- (MeteringMode) meteringMode
+{
+    return meteringMode;
+}
+
+
+//
+// Weights are given row by row, HISTOGRAM_ZONE_COLUMNS per row
+//
+- (void) setMeteringMask:(const float *)weights
+{
+    int i;
+    
+    for (i = 0; i < HISTOGRAM_NUM_ZONES; i++) 
+        meteringMask[i] = (weights[i] > 0.0f) ? weights[i] : 0.0f;
+    
+    if (meteringMode == meteringMask) 
+        [self setMeteringMode:meteringMask];
+}
+
+
+//
+// Mode, mask and weights, without working them out again
+//
+- (void) copyMeteringFrom:(Histogram *)other
+{
+    meteringMode = other->meteringMode;
+    memcpy(meteringMask, other->meteringMask, sizeof(meteringMask));
+    memcpy(meteringWeight, other->meteringWeight, sizeof(meteringWeight));
+    meteringWeightTotal = other->meteringWeightTotal;
+}
+
+
+- (int) getMeteredLuminance
+{
+    return metered;
+}
+
+
 - (void) calculateStatistics
 {
     int i;
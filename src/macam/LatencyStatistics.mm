@@ -0,0 +1,129 @@
+//
+//  LatencyStatistics.m
+//  macam
+//
+//  Where the time goes between the USB bus and the application.
+//
+
+#import "LatencyStatistics.h"
+
+#include "MiscTools.h"
+#include <math.h>
+
+
+@implementation LatencyStatistics
+
+- (id) init
+{
+	self = [super init];
+	if (self == NULL) 
+        return NULL;
+    
+    [self reset];
+    
+    return self;
+}
+
+
+- (void) reset
+{
+    memset((void *) buckets, 0, sizeof(buckets));
+    memset((void *) count, 0, sizeof(count));
+    memset((void *) maxMicroSeconds, 0, sizeof(maxMicroSeconds));
+    AtomicBarrier();
+}
+
+
+- (void) addSample:(UInt64)ticks toStage:(LatencyStage)stage
+{
+    int32_t us = (int32_t) MIN(TicksToMilliseconds(ticks) * 1000.0, (double) INT32_MAX);
+    int bucket = (int) (LATENCY_BUCKETS_PER_OCTAVE * log2(us + 1.0));
+    int32_t max;
+    
+    if (bucket >= LATENCY_BUCKETS) 
+        bucket = LATENCY_BUCKETS - 1;
+    
+    AtomicCount32(&buckets[stage][bucket]);
+    AtomicCount32(&count[stage]);
+    
+    do 
+    {
+        max = maxMicroSeconds[stage];
+        if (us <= max) 
+            break;
+    } 
+    while (!AtomicCompareAndSwap32(&maxMicroSeconds[stage], max, us));
+}
+
+//
+// Add the stages after first up to last, each measured from the one before. 
+// Stamps that are missing (0) are skipped over.
+//
+- (void) recordStamps:(const UInt64 *)stamps from:(LatencyStage)first to:(LatencyStage)last
+{
+    int stage, previous = first;
+    
+    for (stage = first + 1; stage <= last && stage < latencyTotal; stage++) 
+    {
+        if (stamps[stage] == 0 || stamps[previous] == 0 || stamps[stage] < stamps[previous]) 
+            continue;
+        
+        [self addSample:stamps[stage] - stamps[previous] toStage:(LatencyStage) stage];
+        previous = stage;
+    }
+    
+    if (last == latencyPickedUp && stamps[latencyUsbComplete] != 0 && stamps[latencyPickedUp] > stamps[latencyUsbComplete]) 
+        [self addSample:stamps[latencyPickedUp] - stamps[latencyUsbComplete] toStage:latencyTotal];
+}
+
+
+- (LatencyPercentiles) percentilesForStage:(LatencyStage)stage
+{
+    LatencyPercentiles result = { 0, 0.0, 0.0, 0.0, 0.0 };
+    float * targets[3] = { &result.p50, &result.p95, &result.p99 };
+    float fractions[3] = { 0.50, 0.95, 0.99 };
+    int i, t = 0, total = count[stage], sum = 0;
+    
+    if (total == 0) 
+        return result;
+    
+    for (i = 0; i < LATENCY_BUCKETS && t < 3; i++) 
+    {
+        sum += buckets[stage][i];
+        
+        while (t < 3 && sum >= fractions[t] * total) 
+        {
+            float us = exp2((i + 0.5) / LATENCY_BUCKETS_PER_OCTAVE) - 1.0;  // Middle of the bucket
+            *targets[t++] = us / 1000.0;
+        }
+    }
+    
+    result.count = total;
+    result.max = maxMicroSeconds[stage] / 1000.0;
+    
+    for (t = 0; t < 3; t++)  // The middle of a bucket can be past the largest sample
+        if (*targets[t] > result.max) 
+            *targets[t] = result.max;
+    
+    return result;
+}
+
+
++ (const char *) nameOfStage:(LatencyStage)stage
+{
+    switch (stage) 
+    {
+        case latencyUsbComplete:  return "usb";
+        case latencyChunkFull:    return "queue";
+        case latencyDecodeStart:  return "wait";
+        case latencyDecodeEnd:    return "decode";
+        case latencyDelivered:    return "deliver";
+        case latencyPickedUp:     return "pickup";
+        case latencyTotal:        return "total";
+        default:                  break;
+    }
+    
+    return "";
+}
+
+@end
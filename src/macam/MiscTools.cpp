@@ -21,6 +21,7 @@
 #include "MiscTools.h"
 #include "pthread.h"
 #include "sched.h"
+#include <mach/mach_time.h>
 #include "Resolvers.h"
 
 void CStr2PStr(const char* cstr, unsigned char* pstr) {
@@ -77,6 +78,28 @@ void OSXYieldToAnyThread(void) {
     sched_yield();
 }
 
+static double TicksPerMillisecond(void) {
+    static double ticksPerMs=0.0;
+    if (ticksPerMs==0.0) {
+        mach_timebase_info_data_t info;
+        mach_timebase_info(&info);
+        ticksPerMs=1000000.0*info.denom/info.numer;
+    }
+    return ticksPerMs;
+}
+
+UInt64 MonotonicTicks(void) {
+    return mach_absolute_time();
+}
+
+double TicksToMilliseconds(UInt64 ticks) {
+    return ticks/TicksPerMillisecond();
+}
+
+UInt64 MillisecondsToTicks(double ms) {
+    return (UInt64)(ms*TicksPerMillisecond());
+}
+
 short CountPipes(IOUSBInterfaceInterface **intf) {
     UInt8 count;
     IOReturn err;
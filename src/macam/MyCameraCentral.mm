@@ -126,6 +126,9 @@ MyCameraCentral* sharedCameraCentral=NULL;
     [super init];
     cameraTypes=[[NSMutableArray alloc] initWithCapacity:10];
     cameras=[[NSMutableArray alloc] initWithCapacity:10];
+    camerasByID=[[NSMutableDictionary alloc] initWithCapacity:10];
+    camerasByLocationID=[[NSMutableDictionary alloc] initWithCapacity:10];
+    camerasVersion=0;
     delegate=NULL;
     inVDIG = NO;
 	started = false;
@@ -163,6 +166,14 @@ MyCameraCentral* sharedCameraCentral=NULL;
         [cameras release]; 
     cameras=NULL;
     
+    if (camerasByID!=NULL) 
+        [camerasByID release]; 
+    camerasByID=NULL;
+    
+    if (camerasByLocationID!=NULL) 
+        [camerasByLocationID release]; 
+    camerasByLocationID=NULL;
+    
     [super dealloc]; // where is the constructor?
 }
 
@@ -400,6 +411,12 @@ MyCameraCentral* sharedCameraCentral=NULL;
     NSAutoreleasePool* pool=[[NSAutoreleasePool alloc] init];	//Get a pool to catch the remaining drivers
 
     //shutdown all cameras
+    @synchronized(self)
+    {
+        [camerasByID removeAllObjects];
+        [camerasByLocationID removeAllObjects];
+        camerasVersion++;
+    }
     while ([cameras count]>0) {
         info=[cameras lastObject];
         [cameras removeLastObject];
@@ -447,60 +464,91 @@ MyCameraCentral* sharedCameraCentral=NULL;
 	return cameras;
 }
 
+//The camera list changes from other threads (deviceAdded, deviceRemoved, shutdown), so the index 
+//accessors take the same lock. An index is only good as long as the list doesn't change, though.
 - (short) numCameras {
-    return [cameras count];
+    @synchronized(self)
+    {
+        return [cameras count];
+    }
 }
 
 - (short) indexOfCamera:(MyCameraDriver*)driver {
-    short i=0;
-    while (i<[cameras count]) {
-        if ([[cameras objectAtIndex:i] driver]==driver) return i;
-        else i++;
+    @synchronized(self)
+    {
+        short i=0;
+        while (i<[cameras count]) {
+            if ([[cameras objectAtIndex:i] driver]==driver) return i;
+            else i++;
+        }
     }
     return -1;
 }
 
 - (short) indexOfDriverClass:(Class)driverClass 
 {
-    short i=0;
-    while (i<[cameras count]) 
+    @synchronized(self)
     {
-        if ([[cameras objectAtIndex:i] driverClass] == driverClass) 
-            return i;
-        else i++;
+        short i=0;
+        while (i<[cameras count]) 
+        {
+            if ([[cameras objectAtIndex:i] driverClass] == driverClass) 
+                return i;
+            else i++;
+        }
     }
     return -1;
 }
 
 - (unsigned long) idOfCameraWithIndex:(short)idx {
-    if ((idx<0)||(idx>=[self numCameras])) return 0;
-    return [[cameras objectAtIndex:idx] cid];
+    @synchronized(self)
+    {
+        if ((idx<0)||(idx>=[cameras count])) return 0;
+        return [[cameras objectAtIndex:idx] cid];
+    }
 }
 
 - (UInt16) versionOfCameraWithIndex:(short)idx 
 {
-    if ((idx < 0) || (idx >= [self numCameras])) 
-        return 0;
-    
-    return [[cameras objectAtIndex:idx] versionNumber];
+    @synchronized(self)
+    {
+        if ((idx < 0) || (idx >= [cameras count])) 
+            return 0;
+        
+        return [[cameras objectAtIndex:idx] versionNumber];
+    }
 }
 
 - (unsigned long) idOfCameraWithLocationID:(UInt32)locID {
-    short i;
-    for (i=0;i<[cameras count];i++) {
-        if ([[cameras objectAtIndex:i] locationID]==locID) return [[cameras objectAtIndex:i] cid];
+    @synchronized(self)
+    {
+        MyCameraInfo* dev=[camerasByLocationID objectForKey:[NSNumber numberWithUnsignedLong:locID]];
+        if (dev) return [dev cid];
     }
     return 0;    
 }
 
+- (BOOL) hasCameraWithID:(unsigned long)cid {
+    @synchronized(self)
+    {
+        return [camerasByID objectForKey:[NSNumber numberWithUnsignedLong:cid]]!=NULL;
+    }
+}
+
+- (UInt32) camerasVersion {
+    return camerasVersion;
+}
+
 - (unsigned long) locationIDOfCameraWithIndex:(short)idx{
-    if ((idx<0)||(idx>=[self numCameras])) return 0;
-    return [[cameras objectAtIndex:idx] locationID];
+    @synchronized(self)
+    {
+        if ((idx<0)||(idx>=[cameras count])) return 0;
+        return [[cameras objectAtIndex:idx] locationID];
+    }
 }
 
 - (CameraError) useCameraWithID:(unsigned long)cid to:(MyCameraDriver**)outCam acceptDummy:(BOOL)acceptDummy 
 {
-    long l;
     MyCameraInfo* dev=NULL;
     MyCameraDriver* cam=NULL;
     CameraError err=CameraErrorOK;
@@ -508,33 +556,35 @@ MyCameraCentral* sharedCameraCentral=NULL;
 	{
 		 *outCam=NULL;
 	}
-    for (l=0; (l<[cameras count]) && (dev==NULL); l++) 
-	{
-        dev=[cameras objectAtIndex:l];
-        if ([dev cid]!=cid)
-		{
-			 dev=NULL;
-		}
-    }
-    if (dev==NULL) 
-	{
-        NSLog(@"MyCameraCentral: cid not found");
-        err=CameraErrorNoCam;
-    }
-    if (!err) 
-	{
-        if ([dev driver])
-		{
-			 err=CameraErrorBusy;
-		}
-    }
-    if (!err) 
-	{
-        cam=[[[dev driverClass] alloc] initWithCentral:self];
-        if (!cam) 
-		{
-            NSLog(@"MyCameraCentral: could not instantiate driver");
-            err=CameraErrorNoMem;
+    //Several cameras may be started at once from different threads (see ofxMacamPs3Eye::initAll). The camera 
+    //is claimed under the lock, the slow USB startup happens outside of it
+    @synchronized(self)
+    {
+        dev=[camerasByID objectForKey:[NSNumber numberWithUnsignedLong:cid]];
+        if (dev==NULL) 
+        {
+            NSLog(@"MyCameraCentral: cid not found");
+            err=CameraErrorNoCam;
+        }
+        if (!err) 
+        {
+            if ([dev driver])
+            {
+                 err=CameraErrorBusy;
+            }
+        }
+        if (!err) 
+        {
+            cam=[[[dev driverClass] alloc] initWithCentral:self];
+            if (!cam) 
+            {
+                NSLog(@"MyCameraCentral: could not instantiate driver");
+                err=CameraErrorNoMem;
+            }
+            else 
+            {
+                [dev setDriver:cam];    //Taken
+            }
         }
     }
     if (!err) 
@@ -544,6 +594,10 @@ MyCameraCentral* sharedCameraCentral=NULL;
         err=[cam startupWithUsbLocationId:[dev locationID]];
         if (err!=CameraErrorOK)
 		{
+            @synchronized(self)
+            {
+                [dev setDriver:NULL];
+            }
             [cam release];
             cam=NULL;
         }
@@ -551,7 +605,6 @@ MyCameraCentral* sharedCameraCentral=NULL;
 
     if (cam!=NULL) 
 	{
-        [dev setDriver:cam];
         //[self setCameraToDefaults:cam];
         if (outCam)
 		{
@@ -568,27 +621,30 @@ MyCameraCentral* sharedCameraCentral=NULL;
 {
     long l;
     
-    for (l = 0; l < [cameras count]; l++) 
-        if ([[cameras objectAtIndex:l] cid] == cid) 
-        {
- 			NSString * name = [[cameras objectAtIndex:l] cameraName]; // get camera name
- 			int  i, counter = 1;
- 			NSString * modifiedName = nil;
-            
- 			for (i = 0; i < [cameras count]; i++)  // look again over all cameras
+    @synchronized(self)
+    {
+        for (l = 0; l < [cameras count]; l++) 
+            if ([[cameras objectAtIndex:l] cid] == cid) 
             {
- 				NSString * findName = [[cameras objectAtIndex:i] cameraName];
-				if( [findName isEqualToString:name]) // Are there any cameras with the same name?
- 				{
- 					if (i == l) 
-                        modifiedName = [NSString stringWithFormat: @"%@ #%d", name, counter];  // We found our own camera again 
+     			NSString * name = [[cameras objectAtIndex:l] cameraName]; // get camera name
+     			int  i, counter = 1;
+     			NSString * modifiedName = nil;
+            
+     			for (i = 0; i < [cameras count]; i++)  // look again over all cameras
+                {
+     				NSString * findName = [[cameras objectAtIndex:i] cameraName];
+    				if( [findName isEqualToString:name]) // Are there any cameras with the same name?
+     				{
+     					if (i == l) 
+                            modifiedName = [NSString stringWithFormat: @"%@ #%d", name, counter];  // We found our own camera again 
                     
- 					counter++;  // Number of cameras with the same name (plus one)
- 				}
- 			}
+     					counter++;  // Number of cameras with the same name (plus one)
+     				}
+     			}
             
-            return (counter > 2) ? modifiedName : name;  // Modify name if more then one camera
-        } 
+                return (counter > 2) ? modifiedName : name;  // Modify name if more then one camera
+            } 
+    }
     
     return NULL;
 }
@@ -597,9 +653,12 @@ MyCameraCentral* sharedCameraCentral=NULL;
 {
     long l;
     
-    for (l = 0; l < [cameras count]; l++) 
-        if ([[cameras objectAtIndex:l] driver] == driver) 
-            return [[cameras objectAtIndex:l] cameraName];
+    @synchronized(self)
+    {
+        for (l = 0; l < [cameras count]; l++) 
+            if ([[cameras objectAtIndex:l] driver] == driver) 
+                return [[cameras objectAtIndex:l] cameraName];
+    }
     
     return NULL;
 }
@@ -621,13 +680,16 @@ MyCameraCentral* sharedCameraCentral=NULL;
     long l;
     NSString * camName = nil;
     
-    for (l = 0; l < [cameras count]; l++) 
-        if ([[cameras objectAtIndex:l] cid] == cid) 
-        {
- 			NSString * name = [[cameras objectAtIndex:l] cameraName];
-            camName = [NSString stringWithFormat: @"%@ #%d", name, cid]; 
- 			// This is not so user friendly but name is not be changed after other cameras unplugging etc.
-        }
+    @synchronized(self)
+    {
+        for (l = 0; l < [cameras count]; l++) 
+            if ([[cameras objectAtIndex:l] cid] == cid) 
+            {
+     			NSString * name = [[cameras objectAtIndex:l] cameraName];
+                camName = [NSString stringWithFormat: @"%@ #%d", name, cid]; 
+     			// This is not so user friendly but name is not be changed after other cameras unplugging etc.
+            }
+    }
     
     if (!camName) 
         return NO;
@@ -822,10 +884,16 @@ void DeviceRemoved( void *refCon,io_service_t service,natural_t messageType,void
     MyCameraInfo* dev=NULL;
 
     //remove the device in the cameras list
-    for (l=0;l<[cameras count];l++) {
-        if ([[cameras objectAtIndex:l] cid]==cid) {
-            dev=[cameras objectAtIndex:l];
-            [cameras removeObjectAtIndex:l];
+    @synchronized(self)
+    {
+        for (l=0;l<[cameras count];l++) {
+            if ([[cameras objectAtIndex:l] cid]==cid) {
+                dev=[cameras objectAtIndex:l];
+                [camerasByLocationID removeObjectForKey:[NSNumber numberWithUnsignedLong:[dev locationID]]];
+                [camerasByID removeObjectForKey:[NSNumber numberWithUnsignedLong:cid]];
+                [cameras removeObjectAtIndex:l];
+                camerasVersion++;
+            }
         }
     }
     if (!dev) {
@@ -896,7 +964,13 @@ void DeviceAdded(void *refCon, io_iterator_t iterator) {
         [dev setVersionNumber:versionNumber];
 
         //Put the new entry to the list of available cameras
-        [cameras addObject:dev];
+        @synchronized(self)
+        {
+            [cameras addObject:dev];
+            [camerasByID setObject:dev forKey:[NSNumber numberWithUnsignedLong:[dev cid]]];
+            [camerasByLocationID setObject:dev forKey:[NSNumber numberWithUnsignedLong:locID]];
+            camerasVersion++;
+        }
 
         //Spread the news that a camera was plugged in
         [self cameraDetected:[dev cid]];
@@ -916,10 +990,13 @@ void DeviceAdded(void *refCon, io_iterator_t iterator) {
 - (void) cameraHasShutDown:(id)sender {
     long i;
     MyCameraInfo* info;
-    for(i=0;i<[cameras count];i++) {
-        info=[cameras objectAtIndex:i];
-        if ([info driver]==sender) {
-            [info setDriver:NULL];	//If it's still in the list: mark it as available
+    @synchronized(self)
+    {
+        for(i=0;i<[cameras count];i++) {
+            info=[cameras objectAtIndex:i];
+            if ([info driver]==sender) {
+                [info setDriver:NULL];	//If it's still in the list: mark it as available
+            }
         }
     }
     [sender autorelease];		//We clear our reference to that driver. When we receive this, we have built it.
@@ -1003,13 +1080,16 @@ void DeviceAdded(void *refCon, io_iterator_t iterator) {
     UInt16 vid, pid;
     MyCameraInfo * info = NULL;
     
-    idx = [self indexOfCamera:camera];
-    if (idx < 0)  // This camera is not listed as connected
-        return NULL;
-    
-    info = [cameras objectAtIndex:idx];
-    vid = [info vendorID];
-    pid = [info productID];
+    @synchronized(self)  // The index has to stay good
+    {
+        idx = [self indexOfCamera:camera];
+        if (idx < 0)  // This camera is not listed as connected
+            return NULL;
+        
+        info = [cameras objectAtIndex:idx];
+        vid = [info vendorID];
+        pid = [info productID];
+    }
     
     return [self cameraDisabledKeyFromVendorID:vid andProductID:pid];
 }
@@ -1060,13 +1140,16 @@ void DeviceAdded(void *refCon, io_iterator_t iterator) {
     UInt16 vid, pid;
     MyCameraInfo * info = NULL;
     
-    idx = [self indexOfCamera:camera];
-    if (idx < 0)  // This camera is not listed as connected
-        return NO;
-    
-    info = [cameras objectAtIndex:idx];
-    vid = [info vendorID];
-    pid = [info productID];
+    @synchronized(self)  // The index has to stay good
+    {
+        idx = [self indexOfCamera:camera];
+        if (idx < 0)  // This camera is not listed as connected
+            return NO;
+        
+        info = [cameras objectAtIndex:idx];
+        vid = [info vendorID];
+        pid = [info productID];
+    }
     
     return [self cameraDisabled:[camera class] withVendorID:vid andProductID:pid];
 }
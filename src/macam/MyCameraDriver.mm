@@ -119,6 +119,10 @@
     mainThreadRunLoop=[NSRunLoop currentRunLoop];
     mainThreadConnection=NULL;
     decodingThreadConnection=NULL;
+    imageAvailable=0;
+    imageWaiters=0;
+    imageWakeup=dispatch_semaphore_create(0);
+    grabbingStopped=dispatch_semaphore_create(0);
     return self;    
 }
 
@@ -164,6 +168,8 @@
 		[imageBufferLock release];
 		imageBufferLock = NULL;
 	}
+    dispatch_release(imageWakeup);
+    dispatch_release(grabbingStopped);
     [super dealloc];
 }
 
@@ -341,6 +347,11 @@
     return 1 / 255.0;
 }
 
+- (float) gainFactorFor:(float)v	// Assume a linear response unless the driver knows better
+{
+    return 1.0 + v;
+}
+
 - (BOOL) agcDisablesGain
 {
     return YES;
@@ -363,6 +374,11 @@
     return 1 / 255.0;
 }
 
+- (float) shutterFactorFor:(float)v
+{
+    return (v > [self shutterStep]) ? v : [self shutterStep];
+}
+
 - (BOOL) agcDisablesShutter
 {
     return YES;
@@ -638,6 +654,23 @@
     return res;
 }
 
+- (BOOL) waitForGrabbingToStop:(long)ms {     //The decoding thread signals grabbingStopped when it is done
+    dispatch_time_t deadline=dispatch_time(DISPATCH_TIME_NOW, (int64_t) ms * NSEC_PER_MSEC);
+    BOOL stopped;
+    for (;;) {
+        [stateLock lock];
+        stopped=!isGrabbing;
+        [stateLock unlock];
+        if (stopped) return YES;
+        if (dispatch_semaphore_wait(grabbingStopped, deadline)!=0) {    //Timed out, one last look
+            [stateLock lock];
+            stopped=!isGrabbing;
+            [stateLock unlock];
+            return stopped;
+        }
+    }
+}
+
 - (BOOL) isGrabbing {	// Returns if the camera is grabbing
     BOOL res;
     [stateLock lock];
@@ -660,6 +693,7 @@
     [stateLock lock];	//We have to lock because other tasks rely on a constant state within their lock
     isGrabbing=NO;
     [stateLock unlock];
+    dispatch_semaphore_signal(grabbingStopped);     //Left over from an earlier grab if nobody waits, then waitForGrabbingToStop just looks again
     [self mergeGrabFinishedWithError:err];
     if (isShuttingDown) {
         [self usbCloseConnection];
@@ -812,16 +846,44 @@
     [self grabFinished:self withError:err];
 }
 
+//Every image used to make a round trip through the connection to the main thread. Now the decoding 
+//thread raises a flag and wakes up whoever waits for it. [imageReady] stays synchronous, the image 
+//buffer is only valid until it returns. A main thread delegate (never, as long as init hardcodes 
+//doNotificationsOnMainThread to NO) gets it through performSelector, with the decoding thread waiting.
 - (void) mergeImageReady {
-    if (doNotificationsOnMainThread) {
-        if ([NSRunLoop currentRunLoop]!=mainThreadRunLoop) {
-            [(id)[decodingThreadConnection rootProxy] mergeImageReady];
-            return;
-        }
+    if (doNotificationsOnMainThread && [NSRunLoop currentRunLoop]!=mainThreadRunLoop) {
+        [self performSelectorOnMainThread:@selector(mergeImageReadyOnMainThread) withObject:NULL waitUntilDone:YES];
+    }
+    else {
+        [self imageReady:self];     //The delegate has the image first
     }
+    AtomicExchange32(&imageAvailable, 1);
+    if (imageWaiters > 0) 
+        dispatch_semaphore_signal(imageWakeup);
+}
+
+- (void) mergeImageReadyOnMainThread {
     [self imageReady:self];
 }
 
+- (BOOL) takeImageAvailable {
+    return AtomicExchange32(&imageAvailable, 0) != 0;
+}
+
+- (BOOL) waitForImage:(double)ms {
+    dispatch_time_t deadline=dispatch_time(DISPATCH_TIME_NOW, (int64_t) (ms * NSEC_PER_MSEC));
+    BOOL got;
+    AtomicIncrement32(&imageWaiters);     //Before looking at the flag, so a new image signals us
+    while (!(got=[self takeImageAvailable])) {
+        if (dispatch_semaphore_wait(imageWakeup, deadline)!=0) {    //Timed out, one last look
+            got=[self takeImageAvailable];
+            break;
+        }
+    }
+    AtomicDecrement32(&imageWaiters);
+    return got;
+}
+
 - (void) mergeCameraHasShutDown {
     if (doNotificationsOnMainThread) {
         if ([NSRunLoop currentRunLoop]!=mainThreadRunLoop) {
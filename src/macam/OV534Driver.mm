@@ -9,6 +9,7 @@
 
 #import "OV534Driver.h"
 #import "ControllerInterface.h"
+#include "PipelineTrace.h"
 
 
 //
@@ -195,6 +196,9 @@
 @interface OV534Driver (Private)
 
 - (void) initCamera;
+- (int) readSensorRegister:(UInt8)reg;
+- (int) writeSensorRegister:(UInt8)reg toValue:(UInt8)val;
+- (BOOL) writeFrameRateRegisters;
 
 @end
 
@@ -233,15 +237,33 @@
     
     [LUT setDefaultOrientation:NormalOrientation];
     
+    sccbLock = [[NSRecursiveLock alloc] init];
+    manualRedGain = 0.5;
+    shadowing = NO;
+    
     driverType = isochronousDriver;
     
     decodingSkipBytes = 0;
     compressionType = proprietaryCompression;
     
+    // The software AGC (when selected) works the shutter first, then the gain
+    
+    [agc setEffects:[NSArray arrayWithObjects:
+                     [NSNumber numberWithInt:agcAffectShutter], 
+                     [NSNumber numberWithInt:agcAffectGain], NULL]];
+    
 	return self;
 }
 
 
+- (void) dealloc
+{
+    [sccbLock release];
+    
+    [super dealloc];
+}
+
+
 - (void) startupCamera
 {
     [self initCamera];
@@ -271,234 +293,294 @@
     {
         fps = fr;
 		resolution = r;
+		[self writeFrameRateRegisters];
+    }
+    
+    [stateLock unlock];
+}
+
+//
+// The clock registers for the current resolution and fps, NO if a write failed
+//
+- (BOOL) writeFrameRateRegisters
+{
+    int divider = -1, total = -1, bridge = -1;
+    
+    //
+    // sensor register 0x11 is the clock divider, 
+    // the six low bits are used, you always add one, 
+    // unbless it is zero, which is when you get crazy 
+    //
+    // when sensor register 0x0d is set to 0x41, the total is 60
+    //                                  to 0xc1, the total is 120
+    //                                  to 0x81, the total is 150 **
+    //
+    // simpe set the total and the divider to get a number
+    //
+    // usually controller register 0xe5 is set to 0x04
+    // except when ** (0x0d is set to 0x81) when it is set to 0x02
+    //
+	
+	if (resolution == ResolutionVGA) 
+	{
+		NSLog( @"OV534Driver:setResolution ResolutionVGA fps:%d", fps);
+		if (fps == 5) 
+        {
+            // 5 = 60 / 12
+			divider = 0x0b;
+			total = 0x41;
+			bridge = 0x04;
+		}
+		else if (fps == 10) 
+        {
+            // 10 = 60 / 6
+			divider = 0x05;
+			total = 0x41;
+			bridge = 0x04;
+		}
+		else if (fps == 15) 
+        {
+            // 15 = 60 / 4
+			divider = 0x03;
+			total = 0x41;
+			bridge = 0x04;
+			//				[self setSensorRegister:0x14 toValue:0x41]; // instead of setting e5 to 04 in Theo's driver
+		}
+		else if (fps == 20) 
+        {
+            // 20 = 60 / 3
+			divider = 0x02;
+			total = 0x41;
+			bridge = 0x04;
+		}
+        else if (fps == 25) 
+        {
+            // cannot use 60, cannot use 120
+            // 25 = 150 / 6
+			divider = 0x05;
+			total = 0x81;
+			bridge = 0x02;
+        }
+        else if (fps == 30) 
+        {
+            // so many choices
+            // 30 = 60 / 2
+            // 30 = 120 / 4
+            // 30 = 150 / 5
+			divider = 0x04;
+			total = 0x81;
+			bridge = 0x02;
+		}
+        else if (fps == 40 || fps == 0) 
+        {
+            // 40 = 120 / 3
+			divider = 0x02;
+			total = 0xc1;
+			bridge = 0x04;
+		}
+        else if (fps == 50) // measures 100 but image not moving
+        {
+            // cannot get this to work!
+            // 50 = 150 / 3
+			divider = 0x02;
+			total = 0x81;
+			bridge = 0x02;
+		}
+        else if (fps == 60) // measures 120 but image not moving
+        {
+            // cannot get this to work
+            // 60 = 120 / 2
+			divider = 0x01;
+			total = 0xc1;
+			bridge = 0x04;
+		}
+	}
+    else if (resolution == ResolutionSIF) 
+    {
+		
+		NSLog( @"OV534Driver:setResolution ResolutionSIF fps:%d", fps);
+		//these were found by sniffing the windows ps3 eye app
+		//maccam reports the fps is either higher or lower than 
+		//what we are asking for - 
+		
+		//one thing we are not able to do is send the messages back and forth
+		//the sniffer reports that when the ps3eye sends a 0x04 the software should send 0x04 back
+		//for 125fps the eye sends 0x02 and we should be sending 0x02 back
+		
+		//also I don't understand this 	[self setSensorRegister:0x14 toValue:0x41];		
+		//the code from here http://forums.ps2dev.org/viewtopic.php?p=75367#75367 - reports 	[self setSensorRegister:0x14 toValue:0x41];		
+		//but the bytes I sniffed with snoopy pro - show 0x09 and 0x00 
+		//hmm might be needed for 320 by 240 and the other one for 640 480????
 		
         //
         // sensor register 0x11 is the clock divider, 
         // the six low bits are used, you always add one, 
         // unbless it is zero, which is when you get crazy 
         //
-        // when sensor register 0x0d is set to 0x41, the total is 60
-        //                                  to 0xc1, the total is 120
-        //                                  to 0x81, the total is 150 **
+        // the speeds are three times as fast for SIF!
+        //
+        // when sensor register 0x0d is set to 0x41, the total is 180
+        //                                  to 0xc1, the total is 360
+        //                                  to 0x81, the total is 450 **
         //
         // simpe set the total and the divider to get a number
         //
         // usually controller register 0xe5 is set to 0x04
         // except when ** (0x0d is set to 0x81) when it is set to 0x02
         //
-		
-		if (resolution == ResolutionVGA) 
-		{
-			NSLog( @"OV534Driver:setResolution ResolutionVGA fps:%d", fps);
-			if (fps == 5) 
-            {
-                // 5 = 60 / 12
-				[self setSensorRegister:0x11 toValue:0x0b];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-			else if (fps == 10) 
-            {
-                // 10 = 60 / 6
-				[self setSensorRegister:0x11 toValue:0x05];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-			else if (fps == 15) 
-            {
-                // 15 = 60 / 4
-				[self setSensorRegister:0x11 toValue:0x03];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-				//				[self setSensorRegister:0x14 toValue:0x41]; // instead of setting e5 to 04 in Theo's driver
-			}
-			else if (fps == 20) 
-            {
-                // 20 = 60 / 3
-				[self setSensorRegister:0x11 toValue:0x02];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-            else if (fps == 25) 
-            {
-                // cannot use 60, cannot use 120
-                // 25 = 150 / 6
-				[self setSensorRegister:0x11 toValue:0x05];
-				[self setSensorRegister:0x0d toValue:0x81];
-				[self verifySetRegister:0xe5 toValue:0x02];
-            }
-            else if (fps == 30) 
-            {
-                // so many choices
-                // 30 = 60 / 2
-                // 30 = 120 / 4
-                // 30 = 150 / 5
-				[self setSensorRegister:0x11 toValue:0x04];
-				[self setSensorRegister:0x0d toValue:0x81];
-				[self verifySetRegister:0xe5 toValue:0x02];
-			}
-            else if (fps == 40 || fps == 0) 
-            {
-                // 40 = 120 / 3
-				[self setSensorRegister:0x11 toValue:0x02];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-            else if (fps == 50) // measures 100 but image not moving
-            {
-                // cannot get this to work!
-                // 50 = 150 / 3
-				[self setSensorRegister:0x11 toValue:0x02];
-				[self setSensorRegister:0x0d toValue:0x81];
-				[self verifySetRegister:0xe5 toValue:0x02];
-			}
-            else if (fps == 60) // measures 120 but image not moving
-            {
-                // cannot get this to work
-                // 60 = 120 / 2
-				[self setSensorRegister:0x11 toValue:0x01];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
+        
+        if (fps == 5) 
+        {
+            // 5 = 180 / 36
+			divider = 0x23;
+			total = 0x41;
+			bridge = 0x04;
+        }
+        else if (fps == 10) 
+        {
+            // 10 = 180 / 18
+			divider = 0x11;
+			total = 0x41;
+			bridge = 0x04;
+        }
+		else if (fps == 15) 
+        {
+            // 15 = 180 / 12
+			divider = 0x0b;
+			total = 0x41;
+			bridge = 0x04;
 		}
-        else if (resolution == ResolutionSIF) 
+        else if (fps == 20) 
         {
-			
-			NSLog( @"OV534Driver:setResolution ResolutionSIF fps:%d", fps);
-			//these were found by sniffing the windows ps3 eye app
-			//maccam reports the fps is either higher or lower than 
-			//what we are asking for - 
-			
-			//one thing we are not able to do is send the messages back and forth
-			//the sniffer reports that when the ps3eye sends a 0x04 the software should send 0x04 back
-			//for 125fps the eye sends 0x02 and we should be sending 0x02 back
-			
-			//also I don't understand this 	[self setSensorRegister:0x14 toValue:0x41];		
-			//the code from here http://forums.ps2dev.org/viewtopic.php?p=75367#75367 - reports 	[self setSensorRegister:0x14 toValue:0x41];		
-			//but the bytes I sniffed with snoopy pro - show 0x09 and 0x00 
-			//hmm might be needed for 320 by 240 and the other one for 640 480????
-			
-            //
-            // sensor register 0x11 is the clock divider, 
-            // the six low bits are used, you always add one, 
-            // unbless it is zero, which is when you get crazy 
-            //
-            // the speeds are three times as fast for SIF!
-            //
-            // when sensor register 0x0d is set to 0x41, the total is 180
-            //                                  to 0xc1, the total is 360
-            //                                  to 0x81, the total is 450 **
-            //
-            // simpe set the total and the divider to get a number
-            //
-            // usually controller register 0xe5 is set to 0x04
-            // except when ** (0x0d is set to 0x81) when it is set to 0x02
-            //
-            
-            if (fps == 5) 
-            {
-                // 5 = 180 / 36
-				[self setSensorRegister:0x11 toValue:0x23];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-            }
-            else if (fps == 10) 
-            {
-                // 10 = 180 / 18
-				[self setSensorRegister:0x11 toValue:0x11];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-            }
-			else if (fps == 15) 
-            {
-                // 15 = 180 / 12
-				[self setSensorRegister:0x11 toValue:0x0b];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-            else if (fps == 20) 
-            {
-                // 20 = 180 / 9
-				[self setSensorRegister:0x11 toValue:0x08];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-            }
-            else if (fps == 25) 
-            {
-                // 25 = 450 / 18
-				[self setSensorRegister:0x11 toValue:0x11];
-				[self setSensorRegister:0x0d toValue:0x81];
-				[self verifySetRegister:0xe5 toValue:0x02];
-            }
-            else if (fps == 30) 
-            {
-                // 30 = 180 / 6
-				[self setSensorRegister:0x11 toValue:0x05];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-            else if (fps == 40) 
-            {
-                // 40 = 360 / 9
-				[self setSensorRegister:0x11 toValue:0x08];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-            else if (fps == 45) 
-            {
-                // 45 = 180 / 4
-				[self setSensorRegister:0x11 toValue:0x03];
-				[self setSensorRegister:0x0d toValue:0x41];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-            else if (fps == 50) 
-            {
-                // 50 = 450 / 9
-				[self setSensorRegister:0x11 toValue:0x08];
-				[self setSensorRegister:0x0d toValue:0x81];
-				[self verifySetRegister:0xe5 toValue:0x02];
-			}
-            else if (fps == 60) 
-            {
-                // 60 = 180 / 3
-                // 60 = 360 / 6
-				[self setSensorRegister:0x11 toValue:0x05];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
-			else if (fps == 75) 
-            {
-                // 75 = 450 / 6
-				[self setSensorRegister:0x11 toValue:0x05];
-				[self setSensorRegister:0x0d toValue:0x81];
-				[self verifySetRegister:0xe5 toValue:0x02];
-			}
-			else if (fps == 90) 
-            {
-                // 90 = 180 / 2
-                // 90 = 360 / 4
-				[self setSensorRegister:0x11 toValue:0x03];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}		
-			else if (fps == 120 || fps == 0) 
-            {
-                // 120 = 360 / 3
-				[self setSensorRegister:0x11 toValue:0x02];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}		
-			else if (fps == 180) 
-            {
-                // 180 = 360 / 2
-				[self setSensorRegister:0x11 toValue:0x01];
-				[self setSensorRegister:0x0d toValue:0xc1];
-				[self verifySetRegister:0xe5 toValue:0x04];
-			}
+            // 20 = 180 / 9
+			divider = 0x08;
+			total = 0x41;
+			bridge = 0x04;
+        }
+        else if (fps == 25) 
+        {
+            // 25 = 450 / 18
+			divider = 0x11;
+			total = 0x81;
+			bridge = 0x02;
+        }
+        else if (fps == 30) 
+        {
+            // 30 = 180 / 6
+			divider = 0x05;
+			total = 0x41;
+			bridge = 0x04;
 		}
+        else if (fps == 40) 
+        {
+            // 40 = 360 / 9
+			divider = 0x08;
+			total = 0xc1;
+			bridge = 0x04;
+		}
+        else if (fps == 45) 
+        {
+            // 45 = 180 / 4
+			divider = 0x03;
+			total = 0x41;
+			bridge = 0x04;
+		}
+        else if (fps == 50) 
+        {
+            // 50 = 450 / 9
+			divider = 0x08;
+			total = 0x81;
+			bridge = 0x02;
+		}
+        else if (fps == 60) 
+        {
+            // 60 = 180 / 3
+            // 60 = 360 / 6
+			divider = 0x05;
+			total = 0xc1;
+			bridge = 0x04;
+		}
+		else if (fps == 75) 
+        {
+            // 75 = 450 / 6
+			divider = 0x05;
+			total = 0x81;
+			bridge = 0x02;
+		}
+		else if (fps == 90) 
+        {
+            // 90 = 180 / 2
+            // 90 = 360 / 4
+			divider = 0x03;
+			total = 0xc1;
+			bridge = 0x04;
+		}		
+		else if (fps == 120 || fps == 0) 
+        {
+            // 120 = 360 / 3
+			divider = 0x02;
+			total = 0xc1;
+			bridge = 0x04;
+		}		
+		else if (fps == 180) 
+        {
+            // 180 = 360 / 2
+			divider = 0x01;
+			total = 0xc1;
+			bridge = 0x04;
+		}
+	}
+    
+    if (divider < 0) 
+        return YES;  // Not a rate this resolution knows, the clock stays as it is
+    
+    if ([self setSensorRegister:0x11 toValue:divider] < 0) 
+        return NO;
+    if ([self setSensorRegister:0x0d toValue:total] < 0) 
+        return NO;
+    if ([self verifySetRegister:0xe5 toValue:bridge] < 0) 
+        return NO;
+    
+    return YES;
+}
+
+//
+// The stream is paused while the clock changes, the frames in flight get thrown away 
+// (the decoder rejects what's cut off) but the USB side and all buffers stay as they are.
+// NO if a write failed, the stream may be stopped then and has to be restarted.
+//
+- (BOOL) canSetFrameRateWhileGrabbing
+{
+    return YES;
+}
+
+
+- (BOOL) setFrameRateWhileGrabbing:(short)fr
+{
+    if (![self supportsResolution:resolution fps:fr]) 
+        return NO;
+    
+    short oldFps = fps;
+    
+    if ([self setRegister:0xe0 toValue:0x09] < 0)  // Stop the sensor stream
+        return NO;
+    
+    fps = fr;
+    if (![self writeFrameRateRegisters]) 
+    {
+        fps = oldFps;
+        [self writeFrameRateRegisters];          // Try to leave it as it was
+        [self setRegister:0xe0 toValue:0x00];
+        return NO;
     }
     
-    [stateLock unlock];
+    if ([self setRegister:0xe0 toValue:0x00] < 0)  // And go again
+    {
+        fps = oldFps;
+        return NO;
+    }
+    
+    return YES;
 }
 
 
@@ -627,6 +709,17 @@
 }
 
 //------------ GAIN ---------------
+static unsigned char gainVal[8] = {0, 4, 8, 10, 15, 20, 24, 31};
+
+static int gainIndex(float v)
+{
+	float val = v * 7.99;
+	if( val >= 8) val = 7;
+	if(val < 0) val = 0;
+	
+	return (int)val;
+}
+
 - (BOOL) canSetGain { return YES; }
 
 - (void) setGain:(float)v {
@@ -652,17 +745,21 @@
 	//	4
 	//	0
 	
-	//unsigned char gainVal[8] = {0, 4, 8, 10, 15, 20, 24, 31};
-	unsigned char gainVal[8] = {0, 4, 8, 10, 15, 20, 24, 31};
-	
-	float val = v * 7.99;
-	if( val >= 8) val = 7;
-	if(val < 0) val = 0;
-	unsigned char uval = gainVal[ (int)val ];
+	unsigned char uval = gainVal[gainIndex(v)];
 	
 	[self setSensorRegister:0x00 toValue:uval];
     [super setGain:v];
 }
+
+//
+// The OV7720 multiplies by (1 + GAIN[4]) * (1 + GAIN[3:0] / 16)
+//
+- (float) gainFactorFor:(float)v
+{
+	unsigned char uval = gainVal[gainIndex(v)];
+	
+	return (1 + (uval >> 4)) * (1 + (uval & 0x0f) / 16.0);
+}
 //----
 
 //------------ SHUTTER ---------------
@@ -680,6 +777,16 @@
     [super setShutter:v];
 }
 
+// The exposure time is proportional to the register
+- (float) shutterFactorFor:(float)v
+{
+	float val = v * 255.0;
+	if( val > 255) val = 255;
+	if(val < 0) val = 0;
+	
+	return ((int)val + 1) / 256.0;
+}
+
 //------------ AUTO GAIN ---------------
 // Gain and shutter combined
 - (BOOL) canSetAutoGain 
@@ -689,7 +796,7 @@
 
 - (void) setAutoGain:(BOOL) v
 {
-	if (v)
+	if (v && [agc mode] == agcNone)  // Otherwise the software AGC does the work
     {
 		[self setSensorRegister:0x13 toValue:0x07 withMask:0x07]; // from 0x05 enables it
         [self setSensorRegister:0x64 toValue:0x03 withMask:0x03];
@@ -717,20 +824,72 @@
     return [super canSetWhiteBalanceModeTo:newMode];
 }
 
+//
+// The sensor's own AWB is kept off (0x63), automatic white balance is done 
+// in software by adjusting the blue and red gains (see AWB)
+//
 - (void) setWhiteBalanceMode: (WhiteBalanceMode) newMode 
 {
-    if (newMode == WhiteBalanceAutomatic) 
+    WhiteBalanceMode oldMode = [self whiteBalanceMode];
+    
+    [self setSensorRegister:0x63 toValue:0xAA];
+    
+    if (newMode == WhiteBalanceAutomatic && oldMode != WhiteBalanceAutomatic) 
     {
-        [self setSensorRegister:0x63 toValue:0xe0];
+        int blue = [self getSensorRegister:0x01];
+        int red = [self getSensorRegister:0x02];
+        
+        manualRedGain = (red < 0) ? 0.5 : red / 255.0;
+        
+        [super setBlueGain:(blue < 0) ? 0.5 : blue / 255.0];
+        [super setRedGain:manualRedGain];
     }
-    else 
+    
+    if (newMode != WhiteBalanceAutomatic && oldMode == WhiteBalanceAutomatic) 
     {
-        [self setSensorRegister:0x63 toValue:0xAA];
+        [self setHue:[self hue]];  // Blue gain
+        [self setRedGain:manualRedGain];
     }
     
     [super setWhiteBalanceMode:newMode];
 }
 
+//
+// Blue and red gain, normalized
+//
+- (BOOL) canSetChannelGains
+{
+    return YES;
+}
+
+- (void) setBlueGain:(float)v
+{
+	float val = v * 255.0;
+	if( val > 255) val = 255;
+	if(val < 0) val = 0;
+	
+	[self setSensorRegister:0x01 toValue:(int)val];
+    [super setBlueGain:v];
+}
+
+- (void) setRedGain:(float)v
+{
+	float val = v * 255.0;
+	if( val > 255) val = 255;
+	if(val < 0) val = 0;
+	
+	[self setSensorRegister:0x02 toValue:(int)val];
+    [super setRedGain:v];
+}
+
+
+//
+// Fewer and the PS3 Eye stalls, see setIsocFrameFunctions
+//
+- (int) minimumNumberOfTransfers
+{
+    return 3;
+}
 
 //
 // Set up some unusual defaults
@@ -817,14 +976,23 @@ void yuv_to_rgb(UInt8 y, UInt8 u, UInt8 v, UInt8 * r, UInt8 * g, UInt8 * b)
     int B = 2;
     
     int row, column;
+    int zoneWidth = [histogram zoneWidth];
+    UInt32 sumU = 0, sumV = 0;
     
     if (buffer->numBytes < (grabContext.chunkBufferLength - 4)) 
         return NO;  // Skip this chunk
     
+    // Collect the luminance per zone and the average color while we are at it, for the AGC and AWB
+    
+    [histogram resetZones];
+    
     for (row = 0; row < rawHeight; row++) 
     {
-		
         UInt8 * out = nextImageBuffer + row * nextImageBufferRowBytes;
+        UInt32 * zone = [histogram zoneSumsForRow:row];
+        UInt32 * zoneEnd = zone + HISTOGRAM_ZONE_COLUMNS;
+        UInt32 zoneSum = 0;
+        int zoneLeft = zoneWidth;
         
         for (column = 0; column < rawWidth; column += 2) 
         {
@@ -838,13 +1006,89 @@ void yuv_to_rgb(UInt8 y, UInt8 u, UInt8 v, UInt8 * r, UInt8 * g, UInt8 * b)
             
             yuv_to_rgb(y2, u, v, out + R, out + G, out + B);
             out += nextImageBufferBPP;
+            
+            zoneSum += y1 + y2;
+            zoneLeft -= 2;
+            sumU += u;
+            sumV += v;
+            
+            if (zoneLeft <= 0 && zone < zoneEnd) 
+            {
+                *zone++ += zoneSum;
+                zoneSum = 0;
+                zoneLeft = zoneWidth;
+            }
         }
         
         if (rawWidth == 320) 
             ptr += rawWidth * 2;
     }	
     
+    [histogram finishZones];
+    [histogram setChromaSumU:sumU v:sumV];
+    
+    grabContext.frameInfo.averageLuminance = [histogram getAverageLuminance];
+    grabContext.frameInfo.averageLuminanceSet = 1;
+    
+    TRACE_BEGIN("LUT", grabContext.traceCamera);
     [LUT processImage:nextImageBuffer numRows:rawHeight rowBytes:nextImageBufferRowBytes bpp:nextImageBufferBPP];
+    TRACE_END("LUT", grabContext.traceCamera);
+    
+    return YES;
+}
+
+//
+// Every eighth row of a chunk that isn't decoded, counted eight times, is 
+// close enough for the AGC and AWB and costs next to nothing
+//
+#define OV534_SAMPLE_ROWS 8
+
+- (BOOL) sampleChunkStatistics: (GenericChunkBuffer *) buffer
+{
+	short rawWidth  = [self width];
+	short rawHeight = [self height];
+    
+    long rowLength = (rawWidth == 320) ? rawWidth * 4 : rawWidth * 2;  // Past the blank right half at 320
+    
+    int row, column;
+    int zoneWidth = [histogram zoneWidth];
+    UInt32 sumU = 0, sumV = 0;
+    
+    if (buffer->numBytes < (grabContext.chunkBufferLength - 4)) 
+        return NO;
+    
+    [histogram resetZones];
+    
+    for (row = 0; row < rawHeight; row += OV534_SAMPLE_ROWS) 
+    {
+        UInt8 * ptr = buffer->buffer + row * rowLength;
+        
+        UInt32 * zone = [histogram zoneSumsForRow:row];
+        UInt32 * zoneEnd = zone + HISTOGRAM_ZONE_COLUMNS;
+        UInt32 zoneSum = 0;
+        int zoneLeft = zoneWidth;
+        
+        for (column = 0; column < rawWidth; column += 2, ptr += 4) 
+        {
+            zoneSum += ptr[0] + ptr[2];
+            sumU += ptr[1];
+            sumV += ptr[3];
+            zoneLeft -= 2;
+            
+            if (zoneLeft <= 0 && zone < zoneEnd) 
+            {
+                *zone++ += zoneSum * OV534_SAMPLE_ROWS;
+                zoneSum = 0;
+                zoneLeft = zoneWidth;
+            }
+        }
+    }
+    
+    [histogram finishZones];
+    [histogram setChromaSumU:sumU * OV534_SAMPLE_ROWS v:sumV * OV534_SAMPLE_ROWS];
+    
+    grabContext.frameInfo.averageLuminance = [histogram getAverageLuminance];
+    grabContext.frameInfo.averageLuminanceSet = 1;
     
     return YES;
 }
@@ -931,7 +1175,51 @@ void yuv_to_rgb(UInt8 y, UInt8 u, UInt8 v, UInt8 * r, UInt8 * g, UInt8 * b)
 }
 
 
+//
+// Sensor registers can be accessed from several threads (the application, 
+// the AGC thread), so each access is done under the lock
+//
 - (int) getSensorRegister:(UInt8)reg
+{
+    int result;
+    
+    TRACE_BEGIN_ARG("getSensorRegister", grabContext.traceCamera, reg);
+    [sccbLock lock];
+    result = [self readSensorRegister:reg];
+    [sccbLock unlock];
+    TRACE_END("getSensorRegister", grabContext.traceCamera);
+    
+    return result;
+}
+
+
+- (int) setSensorRegister:(UInt8)reg toValue:(UInt8)val
+{
+    int result;
+    
+    TRACE_BEGIN_ARG("setSensorRegister", grabContext.traceCamera, reg);
+    [sccbLock lock];
+    result = [self writeSensorRegister:reg toValue:val];
+    [sccbLock unlock];
+    TRACE_END("setSensorRegister", grabContext.traceCamera);
+    
+    return result;
+}
+
+
+- (int) setSensorRegister:(UInt16)reg toValue:(UInt16)val withMask:(UInt16)mask
+{
+    int result;
+    
+    [sccbLock lock];  // Read-modify-write as one
+    result = [super setSensorRegister:reg toValue:val withMask:mask];
+    [sccbLock unlock];
+    
+    return result;
+}
+
+
+- (int) readSensorRegister:(UInt8)reg
 {
     if ([self setRegister:OV534_REG_SCCB_SUBADDR toValue:reg] < 0) 
         return -1;
@@ -958,7 +1246,7 @@ void yuv_to_rgb(UInt8 y, UInt8 u, UInt8 v, UInt8 * r, UInt8 * g, UInt8 * b)
 }
 
 
-- (int) setSensorRegister:(UInt8)reg toValue:(UInt8)val
+- (int) writeSensorRegister:(UInt8)reg toValue:(UInt8)val
 {
     if ([self setRegister:OV534_REG_SCCB_SUBADDR toValue:reg] < 0) 
         return -1;
@@ -969,7 +1257,71 @@ void yuv_to_rgb(UInt8 y, UInt8 u, UInt8 v, UInt8 * r, UInt8 * g, UInt8 * b)
     if ([self setRegister:OV534_REG_SCCB_OPERATION toValue:OV534_SCCB_OP_WRITE_3] < 0) 
         return -1;
     
-    return ([self sccbStatusOK]) ? val : -1;
+    if (![self sccbStatusOK]) 
+        return -1;
+    
+    if (shadowing) 
+    {
+        shadowSet[reg] = YES;
+        shadowValue[reg] = val;
+    }
+    
+    return val;
+}
+
+//
+// The sensor is up once it answers with the OmniVision manufacturer ID
+//
+#define OV534_SENSOR_MIDH 0x7f
+#define OV534_SENSOR_MIDL 0xa2
+
+- (BOOL) isSensorReady
+{
+    BOOL ready;
+    
+    [sccbLock lock];
+    ready = [self sccbStatusOK] && [self readSensorRegister:0x1c] == OV534_SENSOR_MIDH && 
+                                   [self readSensorRegister:0x1d] == OV534_SENSOR_MIDL;
+    [sccbLock unlock];
+    
+    return ready;
+}
+
+
+- (void) startRegisterShadow
+{
+    [sccbLock lock];
+    memset(shadowSet, 0, sizeof(shadowSet));
+    shadowing = YES;
+    [sccbLock unlock];
+}
+
+//
+// Read back what was written since [startRegisterShadow], except the registers 
+// the sensor changes by itself (gain, exposure and the white balance gains)
+//
+- (int) verifyRegisterShadow
+{
+    int reg, mismatches = 0;
+    
+    [sccbLock lock];
+    
+    for (reg = 0; reg < 256; reg++) 
+    {
+        if (!shadowSet[reg]) 
+            continue;
+        
+        if (reg == 0x00 || reg == 0x01 || reg == 0x02 || reg == 0x08 || reg == 0x10 || reg == 0x1f) 
+            continue;
+        
+        if ([self readSensorRegister:reg] != shadowValue[reg]) 
+            mismatches++;
+    }
+    
+    shadowing = NO;
+    [sccbLock unlock];
+    
+    return mismatches;
 }
 
 
@@ -0,0 +1,248 @@
+//
+//  PipelineTrace.m
+//  macam
+//
+//  Timeline of what the grabbing pipeline is doing, for chrome://tracing
+//
+
+#import "PipelineTrace.h"
+
+#include "MiscTools.h"
+#include <pthread.h>
+#include <stdio.h>
+
+
+typedef struct PipelineTraceEvent 
+{
+    UInt64 ticks;
+    const char * name;
+    UInt32 camera;
+    SInt32 arg;     // -1 for none
+    char phase;     // 'B'egin, 'E'nd or 'i'nstant
+} PipelineTraceEvent;
+
+//
+// Rings are never freed (the writer could be reading them), when a thread 
+// ends its ring is handed to the next new thread instead
+//
+typedef struct PipelineTraceRing 
+{
+    struct PipelineTraceRing * next;
+    volatile int32_t inUse;
+    UInt32 thread;
+    char threadName[64];
+    volatile int32_t count;
+    PipelineTraceEvent events[PIPELINE_TRACE_RING];
+} PipelineTraceRing;
+
+
+volatile BOOL pipelineTraceEnabled = NO;
+
+static PipelineTraceRing * volatile rings = NULL;
+static pthread_key_t ringKey;
+static pthread_key_t nameKey;  // The thread's name until it records its first event, it gets no ring before that
+static pthread_once_t keysOnce = PTHREAD_ONCE_INIT;
+
+
+static void ReleaseRing(void * ring) 
+{
+    AtomicCompareAndSwap32(&((PipelineTraceRing *) ring)->inUse, 1, 0);
+}
+
+
+static void CreateKeys(void) 
+{
+    pthread_key_create(&ringKey, ReleaseRing);
+    pthread_key_create(&nameKey, free);
+}
+
+//
+// Rings are only taken when there is something to record, threads that 
+// never do while tracing is on cost nothing
+//
+static PipelineTraceRing * CurrentRing(BOOL create) 
+{
+    PipelineTraceRing * ring;
+    char * name;
+    
+    pthread_once(&keysOnce, CreateKeys);
+    
+    ring = (PipelineTraceRing *) pthread_getspecific(ringKey);
+    if (ring != NULL || !create) 
+        return ring;
+    
+    for (ring = rings; ring != NULL; ring = ring->next)  // Reuse one from a thread that is gone
+        if (AtomicCompareAndSwap32(&ring->inUse, 0, 1)) 
+            break;
+    
+    if (ring == NULL) 
+    {
+        ring = (PipelineTraceRing *) calloc(1, sizeof(PipelineTraceRing));
+        if (ring == NULL) 
+            return NULL;
+        
+        ring->inUse = 1;
+        
+        do 
+            ring->next = rings;
+        while (!AtomicCompareAndSwapPtr((void * volatile *) &rings, ring->next, ring));
+    }
+    
+    ring->count = 0;
+    ring->thread = pthread_mach_thread_np(pthread_self());
+    
+    name = (char *) pthread_getspecific(nameKey);
+    if (name != NULL) 
+        snprintf(ring->threadName, sizeof(ring->threadName), "%s", name);
+    else if (pthread_getname_np(pthread_self(), ring->threadName, sizeof(ring->threadName)) != 0 || ring->threadName[0] == 0) 
+        snprintf(ring->threadName, sizeof(ring->threadName), "%s", pthread_main_np() ? "main" : "thread");
+    AtomicBarrier();
+    
+    pthread_setspecific(ringKey, ring);
+    
+    return ring;
+}
+
+
+void PipelineTraceEnable(BOOL enable) 
+{
+    pipelineTraceEnabled = enable;
+    AtomicBarrier();
+}
+
+//
+// Forget what has been recorded so far. Threads that are recording at the 
+// same time may keep an event or two.
+//
+void PipelineTraceClear(void) 
+{
+    PipelineTraceRing * ring;
+    
+    for (ring = rings; ring != NULL; ring = ring->next) 
+        ring->count = 0;
+    
+    AtomicBarrier();
+}
+
+
+void PipelineTraceNameThread(const char * name) 
+{
+    PipelineTraceRing * ring = CurrentRing(NO);
+    char * copy;
+    
+    if (ring != NULL) 
+    {
+        snprintf(ring->threadName, sizeof(ring->threadName), "%s", name);
+        return;
+    }
+    
+    copy = strdup(name);
+    if (copy == NULL) 
+        return;
+    
+    free(pthread_getspecific(nameKey));
+    pthread_setspecific(nameKey, copy);
+}
+
+
+void PipelineTraceAdd(char phase, const char * name, UInt32 camera, SInt32 arg) 
+{
+    PipelineTraceRing * ring = CurrentRing(YES);
+    PipelineTraceEvent * event;
+    
+    if (ring == NULL) 
+        return;
+    
+    event = &ring->events[ring->count & (PIPELINE_TRACE_RING - 1)];
+    event->ticks = MonotonicTicks();
+    event->name = name;
+    event->camera = camera;
+    event->arg = arg;
+    event->phase = phase;
+    
+    AtomicIncrement32(&ring->count);  // Only this thread writes the ring
+}
+
+//
+// A JSON string, quotes included
+//
+static void WriteJsonString(FILE * file, const char * string) 
+{
+    fputc('"', file);
+    
+    for (; *string != 0; string++) 
+    {
+        unsigned char c = (unsigned char) *string;
+        
+        if (c == '"' || c == '\\') 
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20) 
+            fprintf(file, "\\u%04x", c);
+        else 
+            fputc(c, file);
+    }
+    
+    fputc('"', file);
+}
+
+//
+// Write everything in the rings as a Chrome trace, return NO if the file can't be written
+//
+BOOL PipelineTraceWrite(const char * path) 
+{
+    PipelineTraceRing * ring;
+    FILE * file;
+    BOOL first = YES;
+    
+    file = fopen(path, "w");
+    if (file == NULL) 
+        return NO;
+    
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    
+    for (ring = rings; ring != NULL; ring = ring->next) 
+    {
+        int32_t end = ring->count;
+        int32_t i, start = (end > PIPELINE_TRACE_RING) ? end - PIPELINE_TRACE_RING : 0;
+        UInt32 lastCamera = 0xffffffff;
+        
+        AtomicBarrier();
+        
+        for (i = start; i < end; i++) 
+        {
+            PipelineTraceEvent event = ring->events[i & (PIPELINE_TRACE_RING - 1)];
+            
+            if (ring->count - i > PIPELINE_TRACE_RING) 
+                continue;  // Overwritten while we were at it
+            
+            if (event.camera != lastCamera)  // Name the thread in every camera it shows up in
+            {
+                fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", 
+                        first ? "" : ",\n", (unsigned) event.camera, (unsigned) ring->thread);
+                WriteJsonString(file, ring->threadName);
+                fprintf(file, "}}");
+                fprintf(file, ",\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%u,\"args\":{\"name\":\"camera %u\"}}", 
+                        (unsigned) event.camera, (unsigned) event.camera);
+                lastCamera = event.camera;
+                first = NO;
+            }
+            
+            fprintf(file, ",\n{\"ph\":\"%c\",\"name\":", event.phase);
+            WriteJsonString(file, event.name);
+            fprintf(file, ",\"pid\":%u,\"tid\":%u,\"ts\":%.3f", 
+                    (unsigned) event.camera, (unsigned) ring->thread, TicksToMilliseconds(event.ticks) * 1000.0);
+            
+            if (event.phase == 'i') 
+                fprintf(file, ",\"s\":\"t\"");
+            
+            if (event.arg >= 0) 
+                fprintf(file, ",\"args\":{\"value\":%d}", (int) event.arg);
+            
+            fprintf(file, "}");
+        }
+    }
+    
+    fprintf(file, "\n]}\n");
+    
+    return (fclose(file) == 0) ? YES : NO;
+}
@@ -16,6 +16,7 @@ typedef enum AGCMode
     agcNone,
     agcProvidedAverage,
     agcHistogram,
+    agcProportionalIntegral,
     
 } AGCMode;
 
@@ -71,11 +72,18 @@ typedef enum AGCEffect
     int slowUpdate;
     int updateInterval;
     struct timeval tvLastUpdate;
+    
+    float proportionalGain;
+    float integralGain;
+    float integral;
+    int settleFrames;
+    int settleCount;
 }
 
 - (id) initWithDriver:(MyCameraDriver *) driver;
 
 - (void) setMode:(AGCMode) newMode;
+- (AGCMode) mode;
 - (void) setEffects:(NSArray *) array;
 - (void) setFrameInfo:(struct GenericFrameInfo *) frameInfo;
 - (void) setBrightnessTracking:(BOOL) track;
@@ -85,5 +93,6 @@ typedef enum AGCEffect
 - (BOOL) updateHistogram:(Histogram *) histogram;
 
 - (BOOL) updateVersion1:(int) middle;
+- (BOOL) updateProportionalIntegral:(Histogram *) histogram;
 
 @end
@@ -0,0 +1,46 @@
+//
+//  AWB.h
+//  macam
+//
+//  Software white balance, alongside the AGC.
+//
+
+
+#import <Cocoa/Cocoa.h>
+#import "Histogram.h"
+
+
+//
+// Algorithm for Automatic White Balance
+//
+// Gray world: over a whole scene the average color should come out gray. 
+// The averages come from the decoder (see [Histogram setChromaSumU:v:]) and 
+// the correction is done with the channel gains of the sensor, so it costs 
+// nothing per pixel. Changes are small and infrequent, so that the picture 
+// does not visibly pump.
+//
+
+@class GenericDriver;
+
+
+@interface AWB : NSObject 
+{
+    GenericDriver * driver;
+    
+    BOOL enabled;
+    
+    float maxStep;    // Largest relative change of a gain per update
+    float tolerance;  // Relative error that is left alone
+    
+    int updateInterval;  // in ms
+    struct timeval tvLastUpdate;
+}
+
+- (id) initWithDriver:(GenericDriver *) driver;
+
+- (void) setEnabled:(BOOL) enable;
+- (BOOL) isEnabled;
+
+- (BOOL) update:(Histogram *) histogram;
+
+@end
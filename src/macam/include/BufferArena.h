@@ -0,0 +1,49 @@
+//
+//  BufferArena.h
+//  macam
+//
+//  Keeps the big buffers of a camera around between grabs.
+//
+
+
+#import <Cocoa/Cocoa.h>
+
+//
+// Buffers come out aligned, to a cache line or to a page for anything larger, 
+// and are touched once when they are created so a grab doesn't take page 
+// faults later. A buffer that is given back is kept: the next request for the 
+// same size gets the same memory, so restarting a grab with the same settings 
+// allocates nothing. [trim] frees what nobody asked for again.
+//
+// Thread safe, but meant for setting up and cleaning up, not for every frame.
+//
+
+#define BUFFER_ARENA_ALIGNMENT  64
+
+
+typedef struct BufferArenaBlock
+{
+    void * data;
+    size_t size;
+    BOOL inUse;
+} BufferArenaBlock;
+
+
+@interface BufferArena : NSObject 
+{
+    BufferArenaBlock * blocks;
+    int numBlocks;
+    int maxBlocks;
+    NSLock * lock;
+}
+
+- (id) init;
+
+- (void *) bufferOfSize:(size_t) size;     // NULL if there is no memory
+- (void) recycleBuffer:(void *) data;      // Kept for the next request of the same size
+- (void) trim;                             // Free everything that is not in use
+
+- (size_t) footprint;   // Bytes held, in use or not
+- (size_t) bytesInUse;
+
+@end
@@ -9,23 +9,23 @@
 
 #import <Cocoa/Cocoa.h>
 
-#include <sys/time.h>
+// addFrame just stores a timestamp in a ring, it is called from USB callbacks 
+// so it must be cheap and never lock. Everything else is computed from the 
+// ring when asked for, from whatever thread is asking.
+//
+// Only one thread should call addFrame, any thread can read.
 
-// add every frame, no need to compre times, just store if needed
-// getFPS checks if time difference greaterthan interval, compute new FPS, new time etc
-// otherwise return 
+#define FRAME_COUNTER_RING          1024  // Must be a power of 2
+#define FRAME_COUNTER_MAX_INTERVAL  5000  // ms, what the ring holds at 180 fps, longer intervals are cut to this
 
 
 @interface FrameCounter : NSObject 
 {
-    BOOL timeset;
-    struct timeval start;
-    int frameCount;
+    UInt64 stamps[FRAME_COUNTER_RING];  // In MonotonicTicks
+    volatile int32_t frameCount;        // Total, the next slot is frameCount % FRAME_COUNTER_RING
+    UInt64 start;
+    volatile int64_t lastReport;
     long interval;  // milli-seconds
-    
-    float cumulativeFPS;
-    float currentFPS;
-    float lastFPS;
 }
 
 - (id) init;
@@ -40,4 +40,9 @@
 - (float) getCurrentFPS;
 - (float) getCumulativeFPS;
 
+- (float) getJitter;       // Standard deviation of the frame intervals, in ms
+- (float) getMinInterval;  // in ms
+- (float) getMaxInterval;  // in ms
+- (int) getFrameCount;
+
 @end
@@ -40,8 +40,12 @@
 #import "MyCameraDriver.h"
 #import "BayerConverter.h"
 #import "LookUpTable.h"
+#import "AGC.h"
+#import "LatencyStatistics.h"
+#import "BufferArena.h"
 
 #include "sys/time.h"
+#include <dispatch/dispatch.h>
 
 typedef enum DriverType
 {
@@ -49,14 +53,55 @@ typedef enum DriverType
     bulkDriver,
 } DriverType;
 
+// What to do with chunks when the decoder can't keep up
+
+typedef enum ChunkQueuePolicy 
+{
+    queueOldestFirst,  // Decode in order, the USB callbacks recycle the oldest full chunk when they run out
+    queueLatestOnly,   // Always decode the newest chunk and recycle the older ones, for the lowest latency
+    queueLossless,     // Decode every chunk in order, the USB callbacks wait for the decoder instead
+} ChunkQueuePolicy;
+
+#define GENERIC_BACKPRESSURE_TIMEOUT  25   // ms a lossless queue holds up the USB callbacks before dropping a chunk
+
 // These seem to work well for many cameras
 
 #define GENERIC_FRAMES_PER_TRANSFER  50
-#define GENERIC_MAX_TRANSFERS         5
 #define GENERIC_NUM_TRANSFERS         2
-#define GENERIC_MAX_CHUNK_BUFFERS     9
 #define GENERIC_NUM_CHUNK_BUFFERS     3
 
+// Just sanity limits, the buffers are allocated for every grab
+
+#define GENERIC_MAX_FRAMES_PER_TRANSFER  1000
+#define GENERIC_MAX_TRANSFERS              16
+#define GENERIC_MAX_CHUNK_BUFFERS          64
+
+// Overrides for the defaults above (and the driver's own), 0 keeps the default
+// Takes effect from the next grab
+
+typedef struct GenericGrabConfiguration 
+{
+    int numberOfTransfers;          // USB transfers kept in flight
+    int numberOfFramesPerTransfer;  // USB frames per transfer (isochronous only)
+    int numberOfChunkBuffers;       // Chunks queued between the USB callbacks and the decoder, at least 2
+} GenericGrabConfiguration;
+
+// What a grab with the current configuration and resolution amounts to
+
+typedef struct GenericGrabPlan 
+{
+    int numberOfTransfers;
+    int numberOfFramesPerTransfer;
+    int numberOfChunkBuffers;
+    long chunkBufferLength;   // bytes
+    long memoryFootprint;     // bytes, all grab buffers together
+    float frameInterval;      // ms at the current frame rate, 0 if unknown
+    float transferLatency;    // ms data can sit in an unfinished transfer
+    float queueLatency;       // ms a chunk can wait for the decoder, given the queue policy
+    float worstCaseLatency;   // ms, the two above together
+    float stallTolerance;     // ms the decoder can stall before chunks are lost
+} GenericGrabPlan;
+
 // Define some compression constants
 // In general, these are for general algorithms that are used by more than one driver
 // Proprietary compression code is provided in the specific drivers (e.g. Sonix)
@@ -99,6 +144,7 @@ typedef struct GenericFrameInfo
 // Forward declarations
 
 @class AGC;
+@class AWB;
 @class Histogram;
 @class FrameCounter;
 
@@ -117,7 +163,7 @@ IsocFrameResult  pac207IsocFrameScanner(IOUSBIsocFrame * frame, UInt8 * buffer,
 
 typedef struct GenericTransferContext 
 {
-    IOUSBIsocFrame frameList[GENERIC_FRAMES_PER_TRANSFER]; // The results of the USB frames received
+    IOUSBIsocFrame * frameList;  // The results of the USB frames received (numberOfFramesPerTransfer of them)
     UInt8 * buffer;                                        // This is the place the transfer goes to
 } GenericTransferContext;
 
@@ -128,8 +174,52 @@ typedef struct GenericChunkBuffer
 	struct timeval tv;      // The one to use for synchronization purposes
 	struct timeval tvStart;
 	struct timeval tvDone;
+    UInt64 usbTicks;        // MonotonicTicks when the USB transfer that finished the chunk completed
+    UInt64 fullTicks;       // and when the chunk was queued for decoding
 } GenericChunkBuffer;
 
+// Chunk buffers live in one pool and are passed around by index, through two 
+// single-producer/single-consumer rings: the USB callbacks fill empty chunks 
+// and queue them as full, the decoding thread takes the full ones and gives 
+// them back as empty. Nothing is locked, copied or shifted on the way.
+// 
+// There is one exception: when the decoder falls behind the callbacks take 
+// the oldest full chunk back themselves, so taking from a ring is done with a 
+// compare-and-swap. A ring can never overflow, it is at least as large as the pool.
+
+typedef enum GenericChunkState 
+{
+    chunkEmpty,     // In the empty ring
+    chunkFilling,   // Owned by the USB callbacks
+    chunkFull,      // In the full ring
+    chunkDecoding,  // Owned by the decoding thread
+} GenericChunkState;
+
+typedef struct GenericChunkRing 
+{
+    volatile int32_t read;   // So many were taken, the oldest is at read & mask
+    volatile int32_t write;  // So many were put
+    int32_t mask;            // The size is a power of 2
+    volatile int32_t * chunks;
+} GenericChunkRing;
+
+// Counters for everything that gets lost on the way, per camera
+// They are only ever incremented (atomically), from whichever thread notices
+
+typedef struct GenericGrabStatistics 
+{
+    volatile int32_t receivedChunks;     // Complete chunks received from the camera
+    volatile int32_t invalidChunks;      // Chunks the stream marked as bad (isochronous)
+    volatile int32_t invalidFrames;      // USB frames without valid data (isochronous)
+    volatile int32_t queueOverflows;     // Full chunks recycled before they could be decoded
+    volatile int32_t decoderRejects;     // Chunks the decoder refused, e.g. too short
+    volatile int32_t undecodedChunks;    // Chunks skipped because there was no image buffer to decode into
+    volatile int32_t framesNotConsumed;  // Decoded images the application never picked up
+    volatile int32_t staleChunks;        // Chunks skipped for a newer one (queueLatestOnly)
+    volatile int32_t backpressureStalls; // Times the USB callbacks had to wait for the decoder (queueLossless)
+    volatile int32_t backpressureDrops;  // Chunks lost because the decoder didn't catch up in time (queueLossless)
+} GenericGrabStatistics;
+
 typedef struct ContextAndIndex 
 {
     int transferIndex;
@@ -138,7 +228,7 @@ typedef struct ContextAndIndex
 
 typedef struct GenericGrabContext 
 {
-    ContextAndIndex transferPointers[GENERIC_MAX_TRANSFERS];
+    ContextAndIndex * transferPointers;  // All these arrays have numberOfTransfers or numberOfChunkBuffers entries
     
     int numberOfFramesPerTransfer;
     int numberOfTransfers;
@@ -164,16 +254,14 @@ typedef struct GenericGrabContext
     
     UInt8 grabbingPipe;           // The pipe used by the camer for grabbing, usually 1, but not always
     
-    NSLock * chunkListLock;		  // The lock for access to the empty buffer pool/ full chunk queue
     long chunkBufferLength;		  // The size of the chunk buffers
-    GenericTransferContext transferContexts[GENERIC_MAX_TRANSFERS];  // The transfer contexts
-    GenericChunkBuffer transferBuffers[GENERIC_MAX_TRANSFERS]; // The pool of chunk buffers used for bulk 
-    GenericChunkBuffer emptyChunkBuffers[GENERIC_MAX_CHUNK_BUFFERS]; // The pool of empty (ready-to-fill) chunk buffers
-    GenericChunkBuffer fullChunkBuffers[GENERIC_MAX_CHUNK_BUFFERS];	 // The queue of full (ready-to-decode) chunk buffers (oldest=last)
-    GenericChunkBuffer fillingChunkBuffer; // The chunk buffer currently filling up (only if fillingChunk == true)
-    short numEmptyBuffers;		  // The number of empty (ready-to-fill) buffers in the array above
-    short numFullBuffers;		  // The number of full (ready-to-decode) buffers in the array above
-    bool  fillingChunk;			  // (true) if we're currently filling a buffer
+    GenericTransferContext * transferContexts;  // The transfer contexts
+    GenericChunkBuffer * transferBuffers;       // The pool of chunk buffers used for bulk 
+    GenericChunkBuffer * chunkBuffers;          // The pool of chunk buffers, see GenericChunkRing
+    volatile GenericChunkState * chunkStates;   // Who owns each of them
+    GenericChunkRing emptyChunks; // Ready-to-fill chunks, from the decoder to the callbacks
+    GenericChunkRing fullChunks;  // Ready-to-decode chunks (oldest first), from the callbacks to the decoder
+    int fillingChunk;             // The chunk currently filling up, or -1 (isochronous only)
     
     size_t  headerLength;
     void *  headerData;
@@ -181,6 +269,17 @@ typedef struct GenericGrabContext
     GenericFrameInfo frameInfo;   // Use this to get more information from the frame scanner
     
     FrameCounter * receiveFPS;
+    dispatch_semaphore_t chunkReady;  // Signalled for every chunk queued, the decoder waits on it
+    dispatch_queue_t decodeQueue;     // Shared decoding: the camera's serial queue, chunks go there instead
+    volatile int32_t decodeScheduled; // A pass on decodeQueue is still to come
+    void * decodeTarget;              // The driver, for that pass
+    dispatch_semaphore_t chunkFreed;  // Signalled for every chunk the decoder gives back
+    volatile ChunkQueuePolicy queuePolicy;
+    
+    UInt32 traceCamera;           // How the camera shows up in the PipelineTrace
+    GenericGrabStatistics * statistics;  // Belongs to the driver, survives the context
+    int droppedFrames;            // Invalid frames in a row
+    int droppedChunks;            // Invalid chunks in a row
     
 //  ImageType imageType;          // Is it Bayer, JPEG or something else?
 } GenericGrabContext;
@@ -193,6 +292,9 @@ typedef struct GenericGrabContext
     
     GenericGrabContext grabContext;
     BOOL grabbingThreadRunning;
+    dispatch_semaphore_t grabbingThreadFinished;  // Signalled once when the grabbing thread exits
+    ChunkQueuePolicy queuePolicy;  // Copied into the grab context, which is set up for every grab
+    GenericGrabConfiguration grabConfiguration;
     int videoBulkReadsPending;
     long exactBufferLength;
     long minimumBufferLength;
@@ -204,6 +306,18 @@ typedef struct GenericGrabContext
     Histogram * histogram;
     AGC * agc;  // Automatic Gain Control software algorithm used for some cameras
     
+    AWB * awb;  // Automatic White Balance in software, for cameras with channel gains
+    float blueGain;
+    float redGain;
+    
+    Histogram * agcSnapshot;  // Copy of the histogram zones for the AGC thread
+    Histogram * agcWorking;   // The AGC thread's own copy of it, used outside the lock
+    NSLock * agcSnapshotLock;  // Guards agcSnapshot, the decoding thread only tries it
+    NSCondition * agcCondition;   // Guards agcSnapshotReady and the AGC thread state
+    BOOL agcSnapshotReady;
+    BOOL agcThreadRunning;
+    BOOL agcThreadShouldBeRunning;
+    
     BOOL hardwareBrightness;
     BOOL hardwareContrast;
     BOOL hardwareSaturation;
@@ -250,20 +364,68 @@ typedef struct GenericGrabContext
     
     FrameCounter * displayFPS;
     FrameCounter * receiveFPS;
+    
+    GenericGrabStatistics statistics;
+    
+    LatencyStatistics * latency;
+    UInt64 lastImageStamps[latencyTotal];  // How the last image went through the stages
+    
+    BufferArena * arena;  // Where the transfer and chunk buffers come from
 }
 
 #pragma mark -> Subclass Unlikely to Implement (generic implementation) <-
 
 - (CameraError) startupWithUsbLocationId: (UInt32) usbLocationId;
 - (void) dealloc;
+- (void) configureGrabContext;
 - (BOOL) setupGrabContext;
 - (void) cleanupGrabContext;
 - (void) grabbingThread: (id) data;
 - (CameraError) decodingThread;
+- (void) decodeQueuedChunks;
+
++ (void) setSharedDecoding:(BOOL) shared;
++ (BOOL) sharedDecoding;
 
 - (void) buttonThread:(id)data;
 - (void) mergeCameraEventHappened:(CameraEvent)evt;
 
+- (void) agcThread:(id)data;
+- (void) startAgcThread;
+- (void) stopAgcThread;
+- (void) postAgcSnapshot;
+
+- (GenericGrabStatistics *) grabStatistics;
+- (void) resetGrabStatistics;
+
+- (LatencyStatistics *) latency;
+- (void) getImageBufferStamps:(UInt64 *) stamps;
+
+- (void) setBufferArena:(BufferArena *) newArena;
+- (BufferArena *) bufferArena;
+
+- (void) setAgcMode:(AGCMode) mode;
+- (AGCMode) agcMode;
+- (void) setMeteringMode:(MeteringMode) mode;
+- (void) setMeteringMask:(const float *) weights;
+
+- (void) setQueuePolicy:(ChunkQueuePolicy) policy;
+- (ChunkQueuePolicy) queuePolicy;
+
+- (void) setGrabConfiguration:(GenericGrabConfiguration) configuration;
+- (GenericGrabConfiguration) grabConfiguration;
+- (GenericGrabPlan) planGrab;
+- (int) minimumNumberOfTransfers;
+- (BOOL) sampleChunkStatistics:(GenericChunkBuffer *) buffer;
+
+- (BOOL) canSetFrameRateWhileGrabbing;
+- (BOOL) setFrameRateWhileGrabbing:(short) fr;
+- (BOOL) reconfigureResolution:(CameraResolution) r fps:(short) fr;
+
+- (BOOL) isSensorReady;
+- (void) startRegisterShadow;
+- (int) verifyRegisterShadow;
+
 - (BOOL) setupDecoding;
 - (BOOL) setupJpegCompression;
 - (BOOL) setupJpegVersion1;
@@ -297,6 +459,12 @@ typedef struct GenericGrabContext
 - (BOOL) canSetWhiteBalanceModeTo: (WhiteBalanceMode) newMode;
 - (void) setWhiteBalanceMode: (WhiteBalanceMode) newMode;
 
+- (BOOL) canSetChannelGains;  // Sensor gains used by the software AWB
+- (float) blueGain;
+- (void) setBlueGain: (float) v;
+- (float) redGain;
+- (void) setRedGain: (float) v;
+
 - (UInt8) getButtonPipe;
 - (BOOL) buttonDataHandler:(UInt8 *)data length:(UInt32)length;
 
@@ -12,6 +12,28 @@
 #include <sys/time.h>
 
 
+//
+// Zone metering
+//
+// Decoders that know where the luminance is (e.g. YUV formats) can accumulate it 
+// into a coarse grid of zones while they convert the image. Exposure can then be 
+// judged from a few hundred zone means instead of rescanning every pixel. 
+//
+
+#define HISTOGRAM_ZONE_COLUMNS  16
+#define HISTOGRAM_ZONE_ROWS     12
+#define HISTOGRAM_NUM_ZONES     (HISTOGRAM_ZONE_COLUMNS * HISTOGRAM_ZONE_ROWS)
+
+typedef enum MeteringMode
+{
+    meteringAverage,
+    meteringCenterWeighted,
+    meteringSpot,
+    meteringMask,
+    
+} MeteringMode;
+
+
 @interface Histogram : NSObject 
 {
     int value[256];
@@ -43,6 +65,23 @@
     int low;
     int high;
     struct timeval tvLastDraw;
+    
+    UInt32 zoneSum[HISTOGRAM_NUM_ZONES];
+    int zoneMean[HISTOGRAM_NUM_ZONES];
+    int zoneWidth;
+    int zoneHeight;
+    BOOL zonesAvailable;
+    BOOL newZones;
+    
+    UInt32 chromaSumU;
+    UInt32 chromaSumV;
+    BOOL chromaAvailable;
+    
+    MeteringMode meteringMode;
+    float meteringMask[HISTOGRAM_NUM_ZONES];
+    float meteringWeight[HISTOGRAM_NUM_ZONES];
+    float meteringWeightTotal;
+    int metered;
 }
 
 - (id) init;
@@ -64,6 +103,28 @@
 - (int) getLowPower;
 - (int) getHighPower;
 
+- (void) resetZones;
+- (UInt32 *) zoneSumsForRow:(int)row;
+- (int) zoneWidth;
+- (void) finishZones;
+- (void) copyZonesFrom:(Histogram *)other;
+
+- (BOOL) hasZones;
+- (BOOL) processZones;
+- (const int *) getZoneMeans;
+- (int) getAverageLuminance;
+
+- (void) setChromaSumU:(UInt32)u v:(UInt32)v;
+- (BOOL) hasChroma;
+- (float) getAverageU;
+- (float) getAverageV;
+
+- (void) setMeteringMode:(MeteringMode)mode;
+- (MeteringMode) meteringMode;
+- (void) setMeteringMask:(const float *)weights;
+- (void) copyMeteringFrom:(Histogram *)other;
+- (int) getMeteredLuminance;
+
 - (void) setView:(NSImageView *)view;
 - (void) draw;
 
@@ -0,0 +1,63 @@
+//
+//  LatencyStatistics.h
+//  macam
+//
+//  Where the time goes between the USB bus and the application.
+//
+
+
+#import <Cocoa/Cocoa.h>
+
+//
+// Every frame is stamped (with MonotonicTicks) as it passes each stage. The 
+// time spent getting from one stage to the next goes into a histogram per 
+// stage, plus one for the whole way. The histograms have logarithmic buckets, 
+// a quarter octave wide, so percentiles are within about 10%. 
+//
+// Recording is lock-free and can be done from any thread.
+//
+
+typedef enum LatencyStage
+{
+    latencyUsbComplete,  // The USB transfer with the end of the frame completed
+    latencyChunkFull,    // The chunk is queued for decoding
+    latencyDecodeStart,
+    latencyDecodeEnd,
+    latencyDelivered,    // The delegate is told about the image
+    latencyPickedUp,     // The application has taken the image
+    latencyTotal,        // Not a stage, all the way from USB completion to pick up
+    latencyStages,
+    
+} LatencyStage;
+
+typedef struct LatencyPercentiles
+{
+    int count;
+    float p50;  // All in ms
+    float p95;
+    float p99;
+    float max;
+} LatencyPercentiles;
+
+#define LATENCY_BUCKETS_PER_OCTAVE   4
+#define LATENCY_BUCKETS            100  // Up to 2^25 micro-seconds
+
+
+@interface LatencyStatistics : NSObject 
+{
+    volatile int32_t buckets[latencyStages][LATENCY_BUCKETS];
+    volatile int32_t count[latencyStages];
+    volatile int32_t maxMicroSeconds[latencyStages];
+}
+
+- (id) init;
+- (void) reset;
+
+- (void) addSample:(UInt64)ticks toStage:(LatencyStage)stage;
+- (void) recordStamps:(const UInt64 *)stamps from:(LatencyStage)first to:(LatencyStage)last;
+
+- (LatencyPercentiles) percentilesForStage:(LatencyStage)stage;
+
++ (const char *) nameOfStage:(LatencyStage)stage;
+
+@end
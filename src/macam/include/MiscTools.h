@@ -41,6 +41,21 @@ void ChangeMyThreadPriority(int delta);
 int GetMyThreadPriority(void);
 void OSXYieldToAnyThread(void);
 
+//Monotonic high resolution clock, cheap enough for USB callbacks
+UInt64 MonotonicTicks(void);
+double TicksToMilliseconds(UInt64 ticks);
+UInt64 MillisecondsToTicks(double ms);
+
+//Atomic operations between threads, on the compiler builtins (OSAtomic is deprecated). All are full barriers, except AtomicCount32, which is for statistics
+static inline int32_t AtomicIncrement32(volatile int32_t* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static inline int32_t AtomicDecrement32(volatile int32_t* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static inline void AtomicCount32(volatile int32_t* p) { __atomic_fetch_add(p, 1, __ATOMIC_RELAXED); }
+static inline int32_t AtomicExchange32(volatile int32_t* p, int32_t value) { return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST); }   //Returns the old value
+static inline int AtomicCompareAndSwap32(volatile int32_t* p, int32_t expected, int32_t value) { return __atomic_compare_exchange_n(p, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+static inline int AtomicCompareAndSwap64(volatile int64_t* p, int64_t expected, int64_t value) { return __atomic_compare_exchange_n(p, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+static inline int AtomicCompareAndSwapPtr(void* volatile* p, void* expected, void* value) { return __atomic_compare_exchange_n(p, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+static inline void AtomicBarrier(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
 //Pipes info
 short CountPipes(IOUSBInterfaceInterface **intf);
 void ShowPipeInfo(IOUSBInterfaceInterface **intf, short idx);
@@ -40,7 +40,10 @@
 @interface MyCameraCentral : NSObject {
     NSMutableArray* cameraTypes;	//A list of dictionaries containing long "vendorID", long "productID" and class "class"
     NSMutableArray* cameras;		//A list of cameras currently connected
-/* Why is this ana array and not a dictionary keyed by cid? This will make enumeration simpler - if we implement browsing in the cameras later. On the other hand, finding a cam by cid now requires walking through the array. That's not too bad since that array will probably never be so big...*/
+/* Why is this ana array and not a dictionary keyed by cid? This will make enumeration simpler - if we implement browsing in the cameras later. Finding a cam by cid or USB location goes through the two dictionaries below, which hold the same MyCameraInfos. All three are changed together, under @synchronized(self), when a camera is plugged in or out.*/
+    NSMutableDictionary* camerasByID;		//cid (NSNumber) -> MyCameraInfo
+    NSMutableDictionary* camerasByLocationID;	//locationID (NSNumber) -> MyCameraInfo
+    volatile UInt32 camerasVersion;	//One up each time the list of cameras changes
 
     IBOutlet id delegate;
     BOOL doNotificationsOnMainThread;
@@ -98,6 +101,8 @@
 - (unsigned long) idOfCameraWithIndex:(short)idx;
 - (UInt16) versionOfCameraWithIndex:(short)idx;
 - (unsigned long) idOfCameraWithLocationID:(UInt32)locID;
+- (BOOL) hasCameraWithID:(unsigned long)cid;
+- (UInt32) camerasVersion;	//Changes when a camera is plugged in or out, so a client can cache what it read from the list
 - (unsigned long) locationIDOfCameraWithIndex:(short)idx;
 - (CameraError) useCameraWithID:(unsigned long)cid to:(MyCameraDriver**)outCam acceptDummy:(BOOL)acceptDummy;
 - (NSString*) nameForID:(unsigned long)cid;
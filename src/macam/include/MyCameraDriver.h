@@ -24,6 +24,7 @@
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include "sys/time.h"
+#include <dispatch/dispatch.h>
 #include "GlobalDefs.h"
 #import "MyCameraInfo.h"
 
@@ -104,6 +105,7 @@ typedef enum FlickerType
     BOOL isShutDown;		//If the driver has already been down
     BOOL isUSBOK;		//If USB calls to intf and dev are ok. Unset without lock to be as fast as possible
     NSLock* stateLock;		//The Lock to mutex all of this stuff
+    dispatch_semaphore_t grabbingStopped;	//Signalled every time isGrabbing goes back to NO, see [waitForGrabbingToStop:]
     
 /* Stuff for merging notifications. Init these if you want to use the merging notification forwarders and the client wants notifications on the main thread. This is a good candidate for refacturing... */
     
@@ -112,6 +114,12 @@ typedef enum FlickerType
     NSConnection* mainThreadConnection;
     NSConnection* decodingThreadConnection;
 
+/* Images don't go through the connections above. A flag says an image is there and whoever waits for one gets woken up. */
+    
+    volatile int32_t imageAvailable;        // Set by [mergeImageReady], cleared by [takeImageAvailable]
+    volatile int32_t imageWaiters;          // Threads in [waitForImage:]
+    dispatch_semaphore_t imageWakeup;
+
 /*
 
 Image buffers. There are two sets: lastIamgeBuffer and nextImageBuffer. The client writes the next buffer to fill into nextImageBuffer via [setImageBuffer]. This also sets nextImageBufferSet to true, indicating the driver that image data may be written into it. The driver then writes the next available image into this buffer, copies the properties into lastImageBuffer and unsets nextImageBuffer. The read functions for the client may then read out lastImageBuffer. There is a lock to manage the access to these variables, imageBufferLock. The get functions don't use the lock since they don't change anything. They are only guaranteed to be valid during the [imageReady] notification. Setting nextImageBuffer is locked during the whole procedure of decoding the image. 
@@ -214,6 +222,7 @@ Image buffers. There are two sets: lastIamgeBuffer and nextImageBuffer. The clie
 - (float) gain;
 - (void) setGain:(float)v;
 - (float) gainStep;
+- (float) gainFactorFor:(float)v;	// Amplification relative to the lowest gain, used by the software AGC
 - (BOOL) agcDisablesGain;
 
 // Shutter speed
@@ -221,6 +230,7 @@ Image buffers. There are two sets: lastIamgeBuffer and nextImageBuffer. The clie
 - (float) shutter;
 - (void) setShutter:(float)v;
 - (float) shutterStep;
+- (float) shutterFactorFor:(float)v;	// Exposure time relative to the longest, used by the software AGC
 - (BOOL) agcDisablesShutter;
 
 // Automatic exposure - will affect shutter and gain
@@ -290,6 +300,7 @@ Image buffers. There are two sets: lastIamgeBuffer and nextImageBuffer. The clie
 - (BOOL) stopGrabbing;					//Stop async grabbing. Returns if the camera is grabbing
 - (void) setImageBuffer:(unsigned char*)buffer bpp:(short)bpp rowBytes:(long)rb;	//Set next image buffer to fill
 - (BOOL) isGrabbing;					// Returns if the camera is grabbing
+- (BOOL) waitForGrabbingToStop:(long)ms;		//After stopGrabbing: wait for the decoding thread to finish. Then grabbing can start again on the same connection
 
 //Grabbing internal
 - (void) decodingThreadWrapper:(id)data;		//Don't subclass this...
@@ -337,6 +348,8 @@ Image buffers. There are two sets: lastIamgeBuffer and nextImageBuffer. The clie
 
 //Merged Notification forwarders - should be used for notifications from decodingThread
 - (void) mergeImageReady;
+- (BOOL) takeImageAvailable;                 //Has an image come in since the last call? Clears it
+- (BOOL) waitForImage:(double)ms;             //Same, but waits up to ms for one
 - (void) mergeGrabFinishedWithError:(CameraError)err;
 - (void) mergeCameraHasShutDown;
 //There's no mergeCameraEventHappened because most likely you won't call it from decodingThread. Merge yourself.
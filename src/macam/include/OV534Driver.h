@@ -11,6 +11,14 @@
 
 
 @interface OV534Driver : GenericDriver 
+{
+    NSRecursiveLock * sccbLock;  // A sensor access takes several transfers, keep them from interleaving
+    float manualRedGain;  // Red gain to return to when leaving automatic white balance
+    
+    BOOL shadowing;             // Remember the sensor registers written (under sccbLock)
+    BOOL shadowSet[256];
+    UInt8 shadowValue[256];
+}
 
 + (NSArray *) cameraUsbDescriptions;
 - (id) initWithCentral:(id)c;
@@ -27,6 +35,10 @@
 - (void) setHue:(float)v;
 - (BOOL) canSetHue;
 
+- (BOOL) canSetChannelGains;
+- (void) setBlueGain:(float)v;
+- (void) setRedGain:(float)v;
+
 - (BOOL) canSetFlicker;
 - (void) setFlicker:(FlickerType)fType;
 
@@ -42,8 +54,13 @@
 - (void) initSCCB;
 - (BOOL) sccbStatusOK;
 
+- (BOOL) isSensorReady;
+- (void) startRegisterShadow;
+- (int) verifyRegisterShadow;
+
 - (int) getSensorRegister:(UInt8)reg;
 - (int) setSensorRegister:(UInt8)reg toValue:(UInt8)val;
+- (int) setSensorRegister:(UInt16)reg toValue:(UInt16)val withMask:(UInt16)mask;
 
 @end
 
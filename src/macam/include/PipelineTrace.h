@@ -0,0 +1,41 @@
+//
+//  PipelineTrace.h
+//  macam
+//
+//  Timeline of what the grabbing pipeline is doing, for chrome://tracing
+//
+
+
+#import <Cocoa/Cocoa.h>
+
+//
+// Events are kept in a ring per thread (the newest PIPELINE_TRACE_RING of them), 
+// so recording never locks and costs about as much as reading the clock. 
+// When tracing is off, the macros cost a test of a global. A thread gets 
+// its ring with the first event it records, so threads that only name 
+// themselves don't cost any memory.
+//
+// Event names must be string constants, only the pointer is stored. The 
+// camera is shown as the process, so every camera gets its own lane. 
+//
+// [PipelineTraceWrite] writes the Trace Event Format (JSON) that Chrome 
+// (chrome://tracing) and Perfetto (ui.perfetto.dev) can open.
+//
+
+#define PIPELINE_TRACE_RING  4096  // Must be a power of 2
+
+#define PIPELINE_TRACE(phase, name, camera, arg) \
+    do { if (pipelineTraceEnabled) PipelineTraceAdd(phase, name, camera, arg); } while (0)
+
+#define TRACE_BEGIN(name, camera)         PIPELINE_TRACE('B', name, camera, -1)
+#define TRACE_BEGIN_ARG(name, camera, a)  PIPELINE_TRACE('B', name, camera, a)
+#define TRACE_END(name, camera)           PIPELINE_TRACE('E', name, camera, -1)
+#define TRACE_INSTANT(name, camera, a)    PIPELINE_TRACE('i', name, camera, a)
+
+extern volatile BOOL pipelineTraceEnabled;
+
+void PipelineTraceEnable(BOOL enable);
+void PipelineTraceClear(void);
+void PipelineTraceNameThread(const char * name);
+void PipelineTraceAdd(char phase, const char * name, UInt32 camera, SInt32 arg);
+BOOL PipelineTraceWrite(const char * path);
@@ -1,37 +1,140 @@
 #pragma once
 
 #include "ofMain.h"
+#include <functional>
 
 #define ofxMacamPs3EyeCast(x) ((PS3EyeWindowAppDelegate*)x)
 
+struct PS3EyeFrame;
+
 struct ofxMacamPs3EyeDeviceInfo{
 	int id;
     unsigned long locationID;
 	char name[255];
 };
 
+// Time (in ms) frames spend getting to a stage of the pipeline from the previous one, starting at the
+// end of the USB transfer: "queue", "wait", "decode", "deliver", "pickup" (by update()), and the "total"
+struct ofxMacamPs3EyeLatency{
+	string stage;
+	int count;
+	float p50;
+	float p95;
+	float p99;
+	float max;
+};
+
+// Where frames and chunks got lost, counted since the grabber was started (or resetStats)
+struct ofxMacamPs3EyeStats{
+	int receivedChunks;    // Complete chunks received from the camera
+	int invalidChunks;     // Chunks the stream marked as bad
+	int invalidFrames;     // USB frames without valid data
+	int queueOverflows;    // Chunks thrown away because the decoder fell behind
+	int decoderRejects;    // Chunks the decoder could not turn into an image
+	int undecodedChunks;   // Chunks not decoded, nobody wanted an image (see setDecodeOnDemand) or the last one was still in use
+	int framesNotConsumed; // Images that arrived before update() picked up the last one
+	int staleChunks;       // Chunks skipped for a newer one (queue policy 1)
+	int backpressureStalls;// Times the USB side had to wait for the decoder (queue policy 2)
+	int backpressureDrops; // Chunks lost anyway because the decoder didn't catch up (queue policy 2)
+};
+
+// What the buffering between the camera and the decoding costs, see setBufferDepth()
+struct ofxMacamPs3EyeBufferPlan{
+	int transfers;
+	int framesPerTransfer;
+	int chunkBuffers;
+	int memoryBytes;        // All the buffers together
+	int allocatedBytes;     // What is really held now, image buffers and buffers kept for a restart included
+	float worstCaseLatency; // ms a frame can spend buffered before it gets decoded
+	float stallTolerance;   // ms the decoding can fall behind before frames are lost
+};
+
+// An image with its capture time, see getNewFrames() and setFrameCallback()
+struct ofxMacamPs3EyeFrameView{
+	const unsigned char * pixels;
+	int width;
+	int height;
+	int stride;            // Bytes per row
+	ofPixelFormat format;
+	double timestamp;      // ms (monotonic clock) when the frame arrived over USB
+	unsigned int sequence; // One up per image since initGrabber()
+};
+
 class ofxMacamPs3Eye {
 public:
+	typedef ofxMacamPs3EyeFrameView FrameView;
+	
 	ofxMacamPs3Eye();
 	~ofxMacamPs3Eye();
 	
 	vector<ofVideoDevice> listDevices();
-	static vector<ofxMacamPs3EyeDeviceInfo*> getDeviceInfoList(bool verbose = false);
+	// The cameras plugged in right now. The list is kept by the addon and only read again after a camera
+	// was plugged in or out, so these are cheap to call, and hand out copies.
+	static vector<ofxMacamPs3EyeDeviceInfo> getDeviceList();
+	static bool getDeviceInfo(int id, ofxMacamPs3EyeDeviceInfo & info);
+	static bool getDeviceInfoByLocationID(unsigned long locationID, ofxMacamPs3EyeDeviceInfo & info);
+	static vector<ofxMacamPs3EyeDeviceInfo*> getDeviceInfoList(bool verbose = false); // The pointers belong to the addon
 	bool initGrabber(int w, int h){ return initGrabber(w, h, true); };
 	bool initGrabber(int w, int h, bool defaultSettingsHack); // Read on the implementation what this hack is about...
+	// Start several cameras at once (set their device IDs first), takes about as long as one initGrabber().
+	// Returns whether each one is grabbing, in the same order. Call from the main thread.
+	static vector<bool> initAll(const vector<ofxMacamPs3Eye*> & grabbers, int w, int h, int fps, bool defaultSettingsHack = true);
     void update();
     bool isFrameNew();
 	
+	// Every image that arrived since the previous update(), oldest first, the last one is in getPixelsRef().
+	// The pixels are valid until the next update(). The ring holds 7 images, what came in beyond
+	// that is lost, counted by getNewFramesLost() (and the gap shows in the sequence numbers).
+	const vector<FrameView> & getNewFrames();
+	int getNewFramesLost();
+	
+	// Block until the camera has delivered a frame since the last call (true), or ms went by (false).
+	// For a loop of its own that wants frames as soon as they are there, call update() after it.
+	bool waitForNewFrame(int ms);
+	
+	// Only decode a frame when update() asks for one, the camera keeps its frame rate but the frames
+	// in between are skipped (and still metered for the auto exposure). Saves most of the decoding
+	// when the camera runs faster than the app. Off by default, and a frame callback turns it off.
+	void setDecodeOnDemand(bool v);
+	bool getDecodeOnDemand();
+	
+	// Called on the decoding thread (a thread of the pool with shared decoding) for every image, at the full camera frame rate, whether
+	// update() gets to see it or not. Keep it short, the next image waits for it. Pass NULL to stop.
+	// The pixels are only valid during the call.
+	void setFrameCallback(std::function<void(const FrameView &)> callback);
+	
 	void setDeviceID(int _deviceID);
 	void setDesiredFrameRate(int framerate);
 	int getDesiredFrameRate();
 	
+	// More buffers survive longer hiccups, but cost memory and (in order) latency. 0 keeps the default.
+	// The PS3 Eye needs at least 3 transfers, chunk buffers are at least 2. framesPerTransfer is for isochronous cameras.
+	void setBufferDepth(int transfers, int chunkBuffers, int framesPerTransfer = 0);
+	ofxMacamPs3EyeBufferPlan getBufferPlan();
+	
     bool setPixelFormat(ofPixelFormat pixelFormat);
     ofPixelFormat getPixelFormat();
     void videoSettings();
     void setVerbose(bool bTalkToMe);
 	
     float getRealFrameRate();
+	float getFrameJitter();        // Standard deviation of the time between frames, in ms
+	float getLongestFrameGap();    // Longest time between two frames, in ms
+	void setFrameRateWindow(int ms); // How far back the three above look, 1000 ms by default, 5000 ms at most
+	vector<ofxMacamPs3EyeLatency> getLatencyStats();
+	void resetLatencyStats();
+	ofxMacamPs3EyeStats getStats();
+	void resetStats();
+	
+	// Decode the images of all cameras on one pool of threads, as many as there are cores, instead of
+	// a thread per camera. Each camera's images still come in order. For the cameras started after this.
+	static void setSharedDecoding(bool shared);
+	static bool getSharedDecoding();
+	
+	// Record a timeline of what the pipelines of all cameras are doing, and save it
+	// as a Chrome trace (open it in chrome://tracing or ui.perfetto.dev)
+	static void setTraceEnabled(bool enabled);
+	static bool saveTrace(string path);
 	
     ofPixels_<unsigned char> & getPixels(){};
 	ofPixels & getPixelsRef();
@@ -77,6 +180,14 @@ public:
 	void setFlicker(int v); // 0 - no flicker, 1 - 50hz, 2 - 60hz
 	void setWhiteBalance(int v);// 1 - linear, 2 - indoor, 3 - outdoor, 4 - auto
 	
+	// Exposure metering
+	void setAutoGainMode(int v); // 0 - camera's own auto exposure, 1 - software metered auto exposure, 2 - software metered, fast converging
+	void setMeteringMode(int v); // 0 - average, 1 - center weighted, 2 - spot, 3 - mask (only with setAutoGainMode(1) or (2))
+	void setMeteringMask(const vector<float> & weights); // 16 x 12 zone weights, row by row, used by metering mode 3
+	
+	// What happens to frames when the decoding can't keep up
+	void setQueuePolicy(int v); // 0 - in order, drop the oldest, 1 - latest frame only (lowest latency), 2 - lossless (wait, and count what still gets lost)
+	
 	float getBrightness();
 	float getContrast();
 	float getGamma();
@@ -87,6 +198,10 @@ public:
 	bool getLed();
 	int getFlicker();
 	int getWhiteBalance();
+	int getAutoGainMode();
+	int getMeteringMode();
+	const vector<float> & getMeteringMask();
+	int getQueuePolicy();
 
     
     //////
@@ -105,6 +220,20 @@ protected:
 	bool isInited;
 	
 	bool autoGainAndShutter;
+	int autoGainMode;
+	int meteringMode;
+	vector<float> meteringMask;
+	void applyMetering();
+	int queuePolicy;
+	int bufferTransfers;
+	int bufferChunks;
+	int bufferFramesPerTransfer;
+	void applyBufferDepth();
+	bool startGrabber(int w, int h);
+	bool reconfigure(int w, int h);
+	bool restartGrabber(int w, int h, bool defaultSettingsHack);
+	void applyDefaultSettings();
+	bool applyDefaultSettingsWhenReady();
 	
 	bool bUseTex;
 	ofTexture tex;
@@ -112,6 +241,11 @@ protected:
 	void* ps3eye;
 	ofPixels pixels;
 	
+	vector<FrameView> newFrames;
+	int newFramesLost;
+	std::function<void(const FrameView &)> frameCallback;
+	static void frameReady(const PS3EyeFrame * frame, void * userData);
+	
 	void exit(ofEventArgs & args){close();};
     
  
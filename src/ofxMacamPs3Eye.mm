@@ -2,6 +2,15 @@
 #include <iostream>
 #include <Cocoa/Cocoa.h>
 #import "PS3EyeWindowAppDelegate.h"
+#import "GenericDriver.h"
+#include "PipelineTrace.h"
+#include "MiscTools.h"
+#include <pthread.h>
+
+#define ofxMacamPs3EyeDriver(x) ((GenericDriver*)ofxMacamPs3EyeCast(x).driver)
+
+#define OFX_MACAM_PS3EYE_READY_TIMEOUT 1500  // ms, what the default settings hack used to sleep
+#define OFX_MACAM_PS3EYE_READY_POLL    5     // ms
 
 ofxMacamPs3Eye::ofxMacamPs3Eye():
 ps3eye([[PS3EyeWindowAppDelegate alloc] init]),
@@ -11,64 +20,136 @@ desiredFPS(180),
 bUseTex(true),
 frameIsNew(false),
 autoGainAndShutter(true),
+autoGainMode(0),
+meteringMode(0),
+meteringMask(HISTOGRAM_NUM_ZONES, 1.0f),
+queuePolicy(0),
+bufferTransfers(0),
+bufferChunks(0),
+bufferFramesPerTransfer(0),
+newFramesLost(0),
 isInited(false)
 {
 	ofAddListener(ofEvents().exit, this, &ofxMacamPs3Eye::exit);
 }
 ofxMacamPs3Eye::~ofxMacamPs3Eye(){
+	[ofxMacamPs3EyeCast(ps3eye) setFrameCallback:NULL userData:NULL];
 	close();
 }
 
+// The cameras the central knows about, read again only when its list changed (a camera was plugged
+// in or out). Behind a mutex, initAll() may look up ids from several threads.
+static pthread_mutex_t deviceRegistryMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool deviceRegistryValid = false;
+static UInt32 deviceRegistryVersion = 0;
+static vector<ofxMacamPs3EyeDeviceInfo> deviceRegistry;
+static map<int, int> deviceRegistryByID;                       // id -> index in deviceRegistry
+static map<unsigned long, int> deviceRegistryByLocationID;     // locationID -> index in deviceRegistry
+static map<int, ofxMacamPs3EyeDeviceInfo*> deviceInfoPointers; // What getDeviceInfoList() hands out, one per id, kept for good
+
+// Call with the mutex held
+static void refreshDeviceRegistry(){
+	MyCameraCentral * central = [MyCameraCentral sharedCameraCentral];
+	// We need to start the central to get this info (returns straight away once it runs)
+	[central startupWithNotificationsOnMainThread:YES recognizeLaterPlugins:YES];
+	if(deviceRegistryValid && [central camerasVersion] == deviceRegistryVersion) return;
+	
+	UInt32 version;
+	do{
+		version = [central camerasVersion];
+		deviceRegistry.clear();
+		deviceRegistryByID.clear();
+		deviceRegistryByLocationID.clear();
+		for(int i = 0; i < [central numCameras]; i++){
+			ofxMacamPs3EyeDeviceInfo info;
+			info.id = [central idOfCameraWithIndex:i];
+			info.locationID = [central locationIDOfCameraWithIndex:i];
+			if(![central getName:info.name forID:info.id maxLength:255]) info.name[0] = 0;
+			deviceRegistryByID[info.id] = deviceRegistry.size();
+			deviceRegistryByLocationID[info.locationID] = deviceRegistry.size();
+			deviceRegistry.push_back(info);
+		}
+	} while(version != [central camerasVersion]); // Plugged in or out while we were reading
+	
+	deviceRegistryVersion = version;
+	deviceRegistryValid = true;
+}
+
 /**
  * This gets the device list and does its best to populate a vector of ofVideoDevices.
  */
 vector<ofVideoDevice> ofxMacamPs3Eye::listDevices() {
     
-    vector<ofxMacamPs3EyeDeviceInfo*> deviceInfos = getDeviceInfoList(true);
+    vector<ofxMacamPs3EyeDeviceInfo> deviceInfos = getDeviceList();
     vector<ofVideoDevice> devices;
     
+	ofLogVerbose("---------------------------");
+	ofLogVerbose("ofxMacamPs3Eye:: Device List");
     for (int i = 0; i < deviceInfos.size(); i++) {
         ofVideoDevice device;
-        device.id = deviceInfos[i]->id;
-        device.deviceName = deviceInfos[i]->name;
+        device.id = deviceInfos[i].id;
+        device.deviceName = deviceInfos[i].name;
         devices.push_back(device);
+		ofLogVerbose("["+ofToString(deviceInfos[i].id)+"] - " + deviceInfos[i].name);
     }
+	ofLogVerbose("---------------------------");
     
     return devices;
 }
 
+vector<ofxMacamPs3EyeDeviceInfo> ofxMacamPs3Eye::getDeviceList(){
+	pthread_mutex_lock(&deviceRegistryMutex);
+	refreshDeviceRegistry();
+	vector<ofxMacamPs3EyeDeviceInfo> deviceList = deviceRegistry;
+	pthread_mutex_unlock(&deviceRegistryMutex);
+	return deviceList;
+}
+
+bool ofxMacamPs3Eye::getDeviceInfo(int id, ofxMacamPs3EyeDeviceInfo & info){
+	pthread_mutex_lock(&deviceRegistryMutex);
+	refreshDeviceRegistry();
+	map<int, int>::iterator found = deviceRegistryByID.find(id);
+	bool valid = found != deviceRegistryByID.end();
+	if(valid) info = deviceRegistry[found->second];
+	pthread_mutex_unlock(&deviceRegistryMutex);
+	return valid;
+}
+
+bool ofxMacamPs3Eye::getDeviceInfoByLocationID(unsigned long locationID, ofxMacamPs3EyeDeviceInfo & info){
+	pthread_mutex_lock(&deviceRegistryMutex);
+	refreshDeviceRegistry();
+	map<unsigned long, int>::iterator found = deviceRegistryByLocationID.find(locationID);
+	bool valid = found != deviceRegistryByLocationID.end();
+	if(valid) info = deviceRegistry[found->second];
+	pthread_mutex_unlock(&deviceRegistryMutex);
+	return valid;
+}
+
 vector<ofxMacamPs3EyeDeviceInfo*> ofxMacamPs3Eye::getDeviceInfoList(bool verbose){
-	// We need to start the central to get this info
-	[[MyCameraCentral sharedCameraCentral] startupWithNotificationsOnMainThread:YES recognizeLaterPlugins:YES];
-	
 	vector<ofxMacamPs3EyeDeviceInfo*> deviceList;
 	
+	pthread_mutex_lock(&deviceRegistryMutex);
+	refreshDeviceRegistry();
 	if(verbose)ofLogVerbose("---------------------------");
 	if(verbose)ofLogVerbose("ofxMacamPs3Eye:: Device List");
-	for(int i = 0; i < [[MyCameraCentral sharedCameraCentral] numCameras]; i++){
-		ofxMacamPs3EyeDeviceInfo * info = new ofxMacamPs3EyeDeviceInfo();
-		info->id = [[MyCameraCentral sharedCameraCentral] idOfCameraWithIndex:i];
-        info->locationID = [[MyCameraCentral sharedCameraCentral] locationIDOfCameraWithIndex:i];
-		[[MyCameraCentral sharedCameraCentral] getName:info->name forID:info->id maxLength:255];
-		deviceList.push_back(info);		
+	for(int i = 0; i < deviceRegistry.size(); i++){
+		ofxMacamPs3EyeDeviceInfo *& info = deviceInfoPointers[deviceRegistry[i].id];
+		if(info == NULL) info = new ofxMacamPs3EyeDeviceInfo();
+		*info = deviceRegistry[i];
+		deviceList.push_back(info);
 		if(verbose)ofLogVerbose("["+ofToString(info->id)+"] - " + info->name);
 	}
 	if(verbose)ofLogVerbose("---------------------------");
+	pthread_mutex_unlock(&deviceRegistryMutex);
 	
 	return deviceList;
 }
 void ofxMacamPs3Eye::setDeviceID(int _deviceID){
-	vector<ofxMacamPs3EyeDeviceInfo*> deviceList = getDeviceInfoList(false);
-	bool idValid = false;
-	for (int i = 0; i < deviceList.size(); i++) {
-		if(_deviceID == deviceList[i]->id){
-			idValid = true;
-			break;
-		}
-	}
-	if (!idValid) {
+	ofxMacamPs3EyeDeviceInfo info;
+	if (!getDeviceInfo(_deviceID, info)) {
+		vector<ofxMacamPs3EyeDeviceInfo> deviceList = getDeviceList();
 		int id;
-		if(deviceList.size()) id = deviceList[0]->id;
+		if(deviceList.size()) id = deviceList[0].id;
 		else id = 0;
 		deviceID = id;
 		ofLogWarning("ofxMacamPs3Eye:: DeviceID ("+ofToString(_deviceID)+") is invalid. Setting id to ("+ofToString(deviceID)+"). Be aware that this id can already be in use.");
@@ -77,36 +158,56 @@ void ofxMacamPs3Eye::setDeviceID(int _deviceID){
 		deviceID = _deviceID;
 	}
 
-	if(isInited) initGrabber(getWidth(), getHeight());
+	if(isInited) restartGrabber(getWidth(), getHeight(), true);
 }
 bool ofxMacamPs3Eye::initGrabber(int w, int h, bool defaultSettingsHack){
+	// Already running, keep the camera (and its settings) and only change what's needed
+	if(reconfigure(w, h)) return true;
+	
+	return restartGrabber(w, h, defaultSettingsHack);
+}
+// Connect anew, for what a running camera can't change: another camera, other buffers
+bool ofxMacamPs3Eye::restartGrabber(int w, int h, bool defaultSettingsHack){
+	bool success = startGrabber(w, h);
+	
+	if(success){
+		if(bUseTex)	tex.allocate(getWidth(), getHeight(), GL_RGB, true);
+		
+		if(defaultSettingsHack){
+			// I had some problems with some default settings not being set
+			// if the camera was in a wierd USB bus (eg. in a thunderbolt display)
+			// So better to force them here.
+			// Setting them straight away was sometimes causing very strange behaviour
+			// on the cameras, so they go in once the sensor is ready and read back right.
+			applyDefaultSettingsWhenReady();
+		}
+	}
+	
+	return success;
+}
+// A running camera gets the new size or frame rate without being closed, see reconfigureWidth:height:fps:
+bool ofxMacamPs3Eye::reconfigure(int w, int h){
+	if(!isInited) return false;
+	if(![ofxMacamPs3EyeCast(ps3eye) reconfigureWidth:w height:h fps:desiredFPS]) return false;
+	
+	if(bUseTex && (tex.getWidth() != getWidth() || tex.getHeight() != getHeight())) tex.allocate(getWidth(), getHeight(), GL_RGB, true);
+	newFrames.clear();
+	newFramesLost = 0;
+	ofLogVerbose("ofxMacamPs3Eye:: Camera "+ofToString(deviceID)+" now at "+ofToString(getWidth())+" x "+ofToString(getHeight())+", "+ofToString(desiredFPS)+" fps");
+	return true;
+}
+// Everything of initGrabber() but the texture and the hack, so it may run off the main thread
+bool ofxMacamPs3Eye::startGrabber(int w, int h){
 	close();
 	if(deviceID == -1) setDeviceID(0);
 	
 	bool success = false;
 	if([ofxMacamPs3EyeCast(ps3eye) connectTo:(unsigned long) deviceID]){
+		applyMetering();
+		[ofxMacamPs3EyeDriver(ps3eye) setQueuePolicy:(ChunkQueuePolicy)queuePolicy];
+		applyBufferDepth();
 		[ofxMacamPs3EyeCast(ps3eye) useWidth:w useHeight:h useFps:desiredFPS];
 		if([ofxMacamPs3EyeCast(ps3eye) startGrabbing]){
-			if(bUseTex)	tex.allocate(getWidth(), getHeight(), GL_RGB, true);
-			
-			if(defaultSettingsHack){
-				ofLogWarning("ofxMacamPs3Eye:: Using 'defaultSettingsHack'. For a faster initialization use initGrabber("+ofToString(w)+", "+ofToString(h)+", false) instead");
-				// I had some problems with some default settings not being set
-				// if the camera was in a wierd USB bus (eg. in a thunderbolt display)
-				// So better to force them here.
-				// The need for this sleep was empirical... setting it straight away was
-				// sometimes causing very strange behaviour on the cameras.
-				ofSleepMillis(1500);
-				setAutoGainAndShutter(true);
-				setBrightness(0.5);
-				setContrast(0.5);
-				setGamma(0.5);
-				setHue(0.5);
-				setFlicker(0);
-				setWhiteBalance(1);
-				setLed(true);
-			}
-			
 			success = true;
 		}
 		
@@ -120,10 +221,99 @@ bool ofxMacamPs3Eye::initGrabber(int w, int h, bool defaultSettingsHack){
 	frameIsNew = false;
 	return success;
 }
+// Instead of a fixed sleep: as soon as the sensor answers, write the defaults and read them back,
+// again until they stick or the time is up
+bool ofxMacamPs3Eye::applyDefaultSettingsWhenReady(){
+	GenericDriver * driver = ofxMacamPs3EyeDriver(ps3eye);
+	unsigned long long start = ofGetElapsedTimeMillis();
+	int attempts = 0;
+	
+	do{
+		if([driver isSensorReady]){
+			[driver startRegisterShadow];
+			applyDefaultSettings();
+			attempts++;
+			int mismatches = [driver verifyRegisterShadow];
+			if(mismatches == 0){
+				ofLogVerbose("ofxMacamPs3Eye:: Default settings in after "+ofToString(ofGetElapsedTimeMillis() - start)+" ms ("+ofToString(attempts)+" attempts)");
+				return true;
+			}
+		}
+		ofSleepMillis(OFX_MACAM_PS3EYE_READY_POLL);
+	} while(ofGetElapsedTimeMillis() - start < OFX_MACAM_PS3EYE_READY_TIMEOUT);
+	
+	ofLogWarning("ofxMacamPs3Eye:: Camera "+ofToString(deviceID)+" didn't take its default settings within "+ofToString(OFX_MACAM_PS3EYE_READY_TIMEOUT)+" ms");
+	return false;
+}
+void ofxMacamPs3Eye::applyDefaultSettings(){
+	setAutoGainAndShutter(true);
+	setBrightness(0.5);
+	setContrast(0.5);
+	setGamma(0.5);
+	setHue(0.5);
+	setFlicker(0);
+	setWhiteBalance(1);
+	setLed(true);
+}
+// The cameras come up at the same time, and get their default settings at the same time
+vector<bool> ofxMacamPs3Eye::initAll(const vector<ofxMacamPs3Eye*> & grabbers, int w, int h, int fps, bool defaultSettingsHack){
+	size_t count = grabbers.size();
+	vector<bool> results(count, false);
+	if(count == 0) return results;
+	
+	bool * started = new bool[count];
+	ofxMacamPs3Eye * const * list = &grabbers[0];
+	
+	for(size_t i = 0; i < count; i++){
+		list[i]->desiredFPS = fps;
+		if(list[i]->deviceID == -1) list[i]->setDeviceID(0); // Here, the central has to start on the main thread
+	}
+	
+	dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t i){
+		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+		started[i] = list[i]->startGrabber(w, h);
+		[pool release];
+	});
+	
+	for(size_t i = 0; i < count; i++){
+		results[i] = started[i];
+		if(started[i] && list[i]->bUseTex) list[i]->tex.allocate(list[i]->getWidth(), list[i]->getHeight(), GL_RGB, true);
+		if(!started[i]) ofLogWarning("ofxMacamPs3Eye:: initAll could not start camera "+ofToString(list[i]->deviceID));
+	}
+	
+	if(defaultSettingsHack){  // See initGrabber()
+		dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t i){
+			NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+			if(started[i]) list[i]->applyDefaultSettingsWhenReady();
+			[pool release];
+		});
+	}
+	
+	delete [] started;
+	return results;
+}
+static ofxMacamPs3EyeFrameView frameViewOf(const PS3EyeFrame * frame){
+	ofxMacamPs3EyeFrameView view;
+	view.pixels = frame->pixels;
+	view.width = frame->width;
+	view.height = frame->height;
+	view.stride = frame->rowBytes;
+	view.format = OF_PIXELS_RGB;
+	view.timestamp = TicksToMilliseconds(frame->captureTicks);
+	view.sequence = frame->sequence;
+	return view;
+}
 void ofxMacamPs3Eye::update(){
-	ofxMacamPs3EyeCast(ps3eye).needsFrame = true;
-	if([ofxMacamPs3EyeCast(ps3eye) isFrameNew]){
+	int count = [ofxMacamPs3EyeCast(ps3eye) takeNewFrames:&newFramesLost];
+	if(count > 0){
+		[ofxMacamPs3EyeCast(ps3eye) framePickedUp];
+		TRACE_INSTANT("update", deviceID, count);
 		frameIsNew = true;
+		newFrames.clear();
+		for(int i = 0; i < count; i++){
+			PS3EyeFrame frame;
+			if([ofxMacamPs3EyeCast(ps3eye) getNewFrame:i frame:&frame]) newFrames.push_back(frameViewOf(&frame));
+		}
 		pixels.setFromExternalPixels([ofxMacamPs3EyeCast(ps3eye) imageBuffer], getWidth(), getHeight(), 3);
 		if (bUseTex) {
 			tex.loadData(getPixels(), getWidth(), getHeight(), GL_RGB);
@@ -131,12 +321,38 @@ void ofxMacamPs3Eye::update(){
 	}
 	else {
 		frameIsNew = false;
+		newFrames.clear();
 	}
 	
 }
+const vector<ofxMacamPs3Eye::FrameView> & ofxMacamPs3Eye::getNewFrames(){
+	return newFrames;
+}
+int ofxMacamPs3Eye::getNewFramesLost(){
+	return newFramesLost;
+}
+bool ofxMacamPs3Eye::waitForNewFrame(int ms){
+	return [ofxMacamPs3EyeDriver(ps3eye) waitForImage:ms];
+}
+void ofxMacamPs3Eye::setDecodeOnDemand(bool v){
+	[ofxMacamPs3EyeCast(ps3eye) setDecodeOnDemand:v];
+}
+bool ofxMacamPs3Eye::getDecodeOnDemand(){
+	return [ofxMacamPs3EyeCast(ps3eye) decodeOnDemand];
+}
 bool ofxMacamPs3Eye::isFrameNew(){
 	return frameIsNew;
 }
+void ofxMacamPs3Eye::setFrameCallback(std::function<void(const FrameView &)> callback){
+	// Unhook first, that also waits for a call in progress
+	[ofxMacamPs3EyeCast(ps3eye) setFrameCallback:NULL userData:NULL];
+	frameCallback = callback;
+	if(frameCallback) [ofxMacamPs3EyeCast(ps3eye) setFrameCallback:&ofxMacamPs3Eye::frameReady userData:this];
+}
+void ofxMacamPs3Eye::frameReady(const PS3EyeFrame * frame, void * userData){
+	ofxMacamPs3Eye * grabber = (ofxMacamPs3Eye *) userData;
+	grabber->frameCallback(frameViewOf(frame));
+}
 
 /*unsigned char * ofxMacamPs3Eye::getPixels(){
 	return pixels.getPixels();
@@ -174,9 +390,110 @@ void ofxMacamPs3Eye::setDesiredFrameRate(int framerate){
 int ofxMacamPs3Eye::getDesiredFrameRate(){
 	return desiredFPS;
 }
+void ofxMacamPs3Eye::setBufferDepth(int transfers, int chunkBuffers, int framesPerTransfer){
+	bufferTransfers = transfers;
+	bufferChunks = chunkBuffers;
+	bufferFramesPerTransfer = framesPerTransfer;
+	if(isInited) restartGrabber(getWidth(), getHeight(), true);
+}
+void ofxMacamPs3Eye::applyBufferDepth(){
+	GenericGrabConfiguration configuration;
+	memset(&configuration, 0, sizeof(configuration));
+	configuration.numberOfTransfers = bufferTransfers;
+	configuration.numberOfChunkBuffers = bufferChunks;
+	configuration.numberOfFramesPerTransfer = bufferFramesPerTransfer;
+	[ofxMacamPs3EyeDriver(ps3eye) setGrabConfiguration:configuration];
+}
+ofxMacamPs3EyeBufferPlan ofxMacamPs3Eye::getBufferPlan(){
+	ofxMacamPs3EyeBufferPlan plan;
+	memset(&plan, 0, sizeof(plan));
+	plan.allocatedBytes = [[ofxMacamPs3EyeCast(ps3eye) bufferArena] footprint];
+	GenericDriver * driver = ofxMacamPs3EyeDriver(ps3eye);
+	if(driver == nil) return plan;
+	
+	applyBufferDepth();
+	GenericGrabPlan grab = [driver planGrab];
+	plan.transfers = grab.numberOfTransfers;
+	plan.framesPerTransfer = grab.numberOfFramesPerTransfer;
+	plan.chunkBuffers = grab.numberOfChunkBuffers;
+	plan.memoryBytes = grab.memoryFootprint;
+	plan.worstCaseLatency = grab.worstCaseLatency;
+	plan.stallTolerance = grab.stallTolerance;
+	return plan;
+}
 float ofxMacamPs3Eye::getRealFrameRate(){
 	return [ofxMacamPs3EyeCast(ps3eye) realFps];
 }
+float ofxMacamPs3Eye::getFrameJitter(){
+	return [[ofxMacamPs3EyeCast(ps3eye) frameCounter] getJitter];
+}
+float ofxMacamPs3Eye::getLongestFrameGap(){
+	return [[ofxMacamPs3EyeCast(ps3eye) frameCounter] getMaxInterval];
+}
+void ofxMacamPs3Eye::setFrameRateWindow(int ms){
+	[[ofxMacamPs3EyeCast(ps3eye) frameCounter] setInterval:MAX(ms, 1)];
+}
+vector<ofxMacamPs3EyeLatency> ofxMacamPs3Eye::getLatencyStats(){
+	vector<ofxMacamPs3EyeLatency> stats;
+	LatencyStatistics * latency = [ofxMacamPs3EyeCast(ps3eye) latency];
+	
+	for(int i = latencyChunkFull; i <= latencyTotal; i++){
+		LatencyPercentiles percentiles = [latency percentilesForStage:(LatencyStage)i];
+		ofxMacamPs3EyeLatency stat;
+		stat.stage = [LatencyStatistics nameOfStage:(LatencyStage)i];
+		stat.count = percentiles.count;
+		stat.p50 = percentiles.p50;
+		stat.p95 = percentiles.p95;
+		stat.p99 = percentiles.p99;
+		stat.max = percentiles.max;
+		stats.push_back(stat);
+	}
+	return stats;
+}
+void ofxMacamPs3Eye::resetLatencyStats(){
+	[[ofxMacamPs3EyeCast(ps3eye) latency] reset];
+}
+ofxMacamPs3EyeStats ofxMacamPs3Eye::getStats(){
+	ofxMacamPs3EyeStats stats;
+	memset(&stats, 0, sizeof(stats));
+	GenericDriver * driver = ofxMacamPs3EyeDriver(ps3eye);
+	if(driver == nil) return stats;
+	
+	GenericGrabStatistics * grab = [driver grabStatistics];
+	stats.receivedChunks = grab->receivedChunks;
+	stats.invalidChunks = grab->invalidChunks;
+	stats.invalidFrames = grab->invalidFrames;
+	stats.queueOverflows = grab->queueOverflows;
+	stats.decoderRejects = grab->decoderRejects;
+	stats.undecodedChunks = grab->undecodedChunks;
+	stats.framesNotConsumed = grab->framesNotConsumed;
+	stats.staleChunks = grab->staleChunks;
+	stats.backpressureStalls = grab->backpressureStalls;
+	stats.backpressureDrops = grab->backpressureDrops;
+	return stats;
+}
+void ofxMacamPs3Eye::resetStats(){
+	GenericDriver * driver = ofxMacamPs3EyeDriver(ps3eye);
+	if(driver != nil) [driver resetGrabStatistics];
+}
+
+void ofxMacamPs3Eye::setSharedDecoding(bool shared){
+	[GenericDriver setSharedDecoding:shared];
+}
+bool ofxMacamPs3Eye::getSharedDecoding(){
+	return [GenericDriver sharedDecoding];
+}
+void ofxMacamPs3Eye::setTraceEnabled(bool enabled){
+	if(enabled) PipelineTraceClear();
+	PipelineTraceEnable(enabled);
+}
+bool ofxMacamPs3Eye::saveTrace(string path){
+	if(!PipelineTraceWrite(ofToDataPath(path).c_str())){
+		ofLogWarning("ofxMacamPs3Eye:: Could not save the trace to "+path+".");
+		return false;
+	}
+	return true;
+}
 
 bool ofxMacamPs3Eye::setPixelFormat(ofPixelFormat pixelFormat) {
 	//note as we only support RGB we are just confirming that this pixel format is supported
@@ -285,4 +602,59 @@ int ofxMacamPs3Eye::getFlicker(){
 }
 int ofxMacamPs3Eye::getWhiteBalance(){
 	return [ofxMacamPs3EyeCast(ps3eye).driver whiteBalanceMode];
-}
\ No newline at end of file
+}
+int ofxMacamPs3Eye::getAutoGainMode(){
+	return autoGainMode;
+}
+int ofxMacamPs3Eye::getMeteringMode(){
+	return meteringMode;
+}
+const vector<float> & ofxMacamPs3Eye::getMeteringMask(){
+	return meteringMask;
+}
+int ofxMacamPs3Eye::getQueuePolicy(){
+	return queuePolicy;
+}
+
+void ofxMacamPs3Eye::setAutoGainMode(int v){
+	if(v < 0 || v > 2){
+		ofLogWarning("ofxMacamPs3Eye:: Invalid auto gain mode ("+ofToString(v)+").");
+		return;
+	}
+	autoGainMode = v;
+	applyMetering();
+}
+void ofxMacamPs3Eye::setMeteringMode(int v){
+	if(v < 0 || v > 3){
+		ofLogWarning("ofxMacamPs3Eye:: Invalid metering mode ("+ofToString(v)+").");
+		return;
+	}
+	meteringMode = v;
+	applyMetering();
+}
+void ofxMacamPs3Eye::setMeteringMask(const vector<float> & weights){
+	if(weights.size() != HISTOGRAM_NUM_ZONES){
+		ofLogWarning("ofxMacamPs3Eye:: Metering mask needs "+ofToString(HISTOGRAM_NUM_ZONES)+" weights ("+ofToString(HISTOGRAM_ZONE_COLUMNS)+" x "+ofToString(HISTOGRAM_ZONE_ROWS)+").");
+		return;
+	}
+	meteringMask = weights;
+	applyMetering();
+}
+void ofxMacamPs3Eye::setQueuePolicy(int v){
+	if(v < 0 || v > 2){
+		ofLogWarning("ofxMacamPs3Eye:: Invalid queue policy ("+ofToString(v)+").");
+		return;
+	}
+	queuePolicy = v;
+	[ofxMacamPs3EyeDriver(ps3eye) setQueuePolicy:(ChunkQueuePolicy)queuePolicy]; // Nothing happens without a driver, initGrabber applies it
+}
+// The driver is recreated on every initGrabber, so the metering settings live here
+void ofxMacamPs3Eye::applyMetering(){
+	GenericDriver * driver = ofxMacamPs3EyeDriver(ps3eye);
+	if(driver == nil) return;
+	
+	[driver setMeteringMask:&meteringMask[0]];
+	[driver setMeteringMode:(MeteringMode)meteringMode];
+	AGCMode modes[3] = {agcNone, agcHistogram, agcProportionalIntegral};
+	[driver setAgcMode:modes[autoGainMode]];
+}